@@ -0,0 +1,163 @@
+#include "QMatrixFile.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char MAGIC[8] = { 'Q', 'S', 'M', 'A', 'T', 'R', 'I', 'X' };
+static const size_t VALUES_ALIGN = 64;
+
+static_assert( std::endian::native == std::endian::little, "matrix files are read in place and are little endian" );
+
+bool QMatrixFile::open(const std::string& filename)
+{
+    close();
+    int fd = ::open( filename.c_str(), O_RDONLY );
+    if (fd < 0) {
+        std::cerr << "cannot open " << filename << "\n";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(QMatrixFileHeader)) {
+        std::cerr << filename << " is too short for a matrix file\n";
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        std::cerr << "cannot map " << filename << "\n";
+        return false;
+    }
+    data = (const char*)p;
+    size = st.st_size;
+
+    const QMatrixFileHeader& h = *(const QMatrixFileHeader*)data;
+    const char* problem = nullptr;
+    if (memcmp( h.magic, MAGIC, sizeof(MAGIC) ) != 0) problem = "not a matrix file";
+    else if (h.version != FORMAT_VERSION) problem = "unknown matrix file version";
+    else if (h.precision != 4 && h.precision != 8) problem = "unknown precision";
+    else if (h.labels_size > size - sizeof(h) || h.values_offset < sizeof(h) + h.labels_size
+             || h.values_offset % VALUES_ALIGN != 0 || h.values_offset > size || h.values_size > size - h.values_offset
+             || h.values_size != (uint64_t)h.dim * (h.dim ? h.dim - 1 : 0) / 2 * h.precision) problem = "truncated or damaged";
+    if (!problem && h.labels_size) {
+        std::string all( data + sizeof(h), h.labels_size );
+        if (all.back() != '\n') problem = "damaged labels";
+        else {
+            for (size_t start = 0, end; start < all.size(); start = end + 1) {
+                end = all.find('\n', start);
+                labels.push_back( all.substr(start, end - start) );
+            }
+            if (labels.size() != h.dim) problem = "label count does not match the dimension";
+        }
+    }
+    if (problem) {
+        std::cerr << filename << ": " << problem << "\n";
+        close();
+        return false;
+    }
+    dim = h.dim;
+    precision = h.precision;
+    values = data + h.values_offset;
+    return true;
+}
+
+void QMatrixFile::close()
+{
+    if (data) munmap( (void*)data, size );
+    data = nullptr;
+    size = 0;
+    dim = 0;
+    precision = 0;
+    labels.clear();
+    values = nullptr;
+}
+
+bool QMatrixFile::is_matrix_file(const std::string& filename)
+{
+    std::ifstream ifs( filename, std::ios_base::binary );
+    char magic[sizeof(MAGIC)];
+    return ifs.read( magic, sizeof(magic) ) && memcmp( magic, MAGIC, sizeof(MAGIC) ) == 0;
+}
+
+double QMatrixFile::value(const unsigned int& i, const unsigned int& j) const
+{
+    if (i == j) return 0.0;
+    size_t k = i < j ? packed_index(i, j, dim) : packed_index(j, i, dim);
+    return precision == 4 ? ((const float*)values)[k] : ((const double*)values)[k];
+}
+
+template<class V, class T> static void unpack(const V* packed, QMatrix<T>& dm)
+{
+    const unsigned int n = dm.dim;
+    for (unsigned int i = 0; i < n; i++) {
+        T* r = dm.row(i);
+        r[i] = 0;
+        const V* from = packed + QMatrixFile::packed_index(i, i + 1, n);
+        for (unsigned int j = i + 1; j < n; j++) r[j] = (T)from[j - i - 1];
+    }
+    // mirror in tiles, so the column writes stay in cache
+    const unsigned int TILE = 64;
+    for (unsigned int bi = 0; bi < n; bi += TILE)
+        for (unsigned int bj = bi; bj < n; bj += TILE)
+            for (unsigned int i = bi; i < std::min(bi + TILE, n); i++)
+                for (unsigned int j = std::max(bj, i + 1); j < std::min(bj + TILE, n); j++)
+                    dm.at(j, i) = dm.at(i, j);
+}
+
+template<class T> void QMatrixFile::to_matrix(QMatrix<T>& dm) const
+{
+    dm.resize(0);
+    dm.resize(dim);
+    dm.labels = labels;
+    if (precision == 4) unpack( (const float*)values, dm );
+    else unpack( (const double*)values, dm );
+}
+
+template<class V, class T> static void pack(const QMatrix<T>& dm, std::string& out)
+{
+    const unsigned int n = dm.dim;
+    size_t at = out.size();
+    out.resize( at + (size_t)n * (n ? n - 1 : 0) / 2 * sizeof(V) );
+    for (unsigned int i = 0; i < n; i++)
+        for (unsigned int j = i + 1; j < n; j++, at += sizeof(V)) {
+            V v = (V)( ( (double)dm.at(i, j) + (double)dm.at(j, i) ) / 2 );
+            memcpy( &out[at], &v, sizeof(V) );
+        }
+}
+
+template<class T> bool QMatrixFile::write(const QMatrix<T>& dm, const std::string& filename, unsigned int precision)
+{
+    if (precision != 4 && precision != 8) return false;
+    std::string label_block;
+    if (dm.labels.size() == dm.dim)
+        for (auto& label : dm.labels) label_block += label + "\n";
+
+    QMatrixFileHeader h;
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, MAGIC, sizeof(MAGIC) );
+    h.version = FORMAT_VERSION;
+    h.dim = dm.dim;
+    h.precision = precision;
+    h.labels_size = label_block.size();
+    h.values_offset = ( sizeof(h) + label_block.size() + VALUES_ALIGN - 1 ) / VALUES_ALIGN * VALUES_ALIGN;
+    h.values_size = (uint64_t)dm.dim * (dm.dim ? dm.dim - 1 : 0) / 2 * precision;
+
+    std::string out( (const char*)&h, sizeof(h) );
+    out += label_block;
+    out.resize( h.values_offset, '\0' );
+    if (precision == 4) pack<float>( dm, out );
+    else pack<double>( dm, out );
+    return write_whole_file( out, filename );
+}
+
+template void QMatrixFile::to_matrix(QMatrix<double>& dm) const;
+template void QMatrixFile::to_matrix(QMatrix<float>& dm) const;
+template void QMatrixFile::to_matrix(QMatrix<unsigned int>& dm) const;
+template bool QMatrixFile::write(const QMatrix<double>& dm, const std::string& filename, unsigned int precision);
+template bool QMatrixFile::write(const QMatrix<float>& dm, const std::string& filename, unsigned int precision);
+template bool QMatrixFile::write(const QMatrix<unsigned int>& dm, const std::string& filename, unsigned int precision);
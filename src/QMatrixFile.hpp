@@ -0,0 +1,60 @@
+#ifndef __QMATRIX_FILE_HPP
+#define __QMATRIX_FILE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "SimpleMatrix.hpp"
+
+// Binary distance matrix file, mapped into memory and read in place: no parsing, no copy.
+// Layout (little endian):
+//   header       64 bytes, see below
+//   labels       labels_size bytes, each label ended by '\n'; none at all for an unlabelled matrix
+//   values       from values_offset (a multiple of 64): the strict upper triangle row by row,
+//                (0,1) (0,2) .. (0,n-1) (1,2) .. (n-2,n-1), as float or double
+// The diagonal is zero and the lower triangle mirrors the upper one, as after make_symmetric.
+struct QMatrixFileHeader {
+    char magic[8];              // "QSMATRIX"
+    uint32_t version;           // FORMAT_VERSION when written
+    uint32_t dim;
+    uint32_t precision;         // bytes per value: 4 (float) or 8 (double)
+    uint32_t reserved;
+    uint64_t labels_size;
+    uint64_t values_offset;
+    uint64_t values_size;
+    char padding[16];
+};
+static_assert( sizeof(QMatrixFileHeader) == 64, "matrix file header must stay 64 bytes" );
+
+struct QMatrixFile {
+    static const uint32_t FORMAT_VERSION = 1;
+
+    const char* data;           // the whole file, mapped read only
+    size_t size;
+    unsigned int dim;
+    unsigned int precision;
+    StringList labels;
+    const void* values;         // packed upper triangle, float or double by precision
+
+    QMatrixFile() : data(nullptr), size(0), dim(0), precision(0), labels(), values(nullptr) {}
+    ~QMatrixFile() { close(); }
+    QMatrixFile(const QMatrixFile&) = delete;
+    QMatrixFile& operator =(const QMatrixFile&) = delete;
+
+    // false, with the reason on stderr, when the file is missing or not a valid matrix file
+    bool open(const std::string& filename);
+    void close();
+    static bool is_matrix_file(const std::string& filename);   // checks the magic only
+
+    // position of (i,j), i < j, in the packed triangle
+    static size_t packed_index(const unsigned int& i, const unsigned int& j, const unsigned int& dim)
+        { return (size_t)i * dim - (size_t)i * (i + 1) / 2 + (j - i - 1); }
+    double value(const unsigned int& i, const unsigned int& j) const;
+
+    // full square matrix with labels, for the code that works on QMatrix
+    template<class T> void to_matrix(QMatrix<T>& dm) const;
+    // writes dm, symmetrized by averaging across the diagonal like make_symmetric
+    template<class T> static bool write(const QMatrix<T>& dm, const std::string& filename, unsigned int precision = 8);
+};
+
+#endif // __QMATRIX_FILE_HPP
@@ -0,0 +1,241 @@
+#include "QSearchCompressor.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef QSEARCH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QSEARCH_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef QSEARCH_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef QSEARCH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// compressed output is counted in chunks of this size and dropped
+static const size_t SCRATCH_SIZE = 16384;
+
+struct UnprimedCompressor : public QSearchPrimedCompressor {
+    const QSearchCompressor& compressor;
+    std::string_view x;
+
+    UnprimedCompressor(const QSearchCompressor& compressor_init, std::string_view x_init) : compressor(compressor_init), x(x_init) {}
+
+    size_t compressed_size(std::string_view y) const override { return compressor.compressed_size(x, y); }
+};
+
+std::unique_ptr< QSearchPrimedCompressor > QSearchCompressor::prime(std::string_view x) const
+{
+    return std::unique_ptr< QSearchPrimedCompressor >( new UnprimedCompressor(*this, x) );
+}
+
+#ifdef QSEARCH_HAVE_ZLIB
+// deflate after x, copied with deflateCopy for every y; the copy carries x's pending output,
+// so the sizes are exactly those of compressing x and y in one go
+struct PrimedDeflate : public QSearchPrimedCompressor {
+    mutable z_stream s;     // only read by deflateCopy, which does not take a const pointer
+    size_t x_size;          // output already produced for x
+
+    ~PrimedDeflate() { deflateEnd(&s); }
+
+    size_t compressed_size(std::string_view y) const override;
+};
+
+struct DeflateCompressor : public QSearchCompressor {
+    std::string id;
+    int window_bits;    // 15 + 16 selects the gzip wrapper
+
+    DeflateCompressor(const std::string& id_init, int window_bits_init) : id(id_init), window_bits(window_bits_init) {}
+
+    std::string name() const override { return id; }
+
+    static size_t feed(z_stream& s, std::string_view in, int flush)
+    {
+        unsigned char out[SCRATCH_SIZE];
+        size_t produced = 0;
+        s.next_in = (Bytef*)in.data();
+        s.avail_in = (uInt)in.size();
+        for (;;) {
+            s.next_out = out;
+            s.avail_out = sizeof(out);
+            int ret = deflate(&s, flush);
+            if (ret == Z_STREAM_ERROR) throw std::runtime_error("deflate failed");
+            produced += sizeof(out) - s.avail_out;
+            if (flush == Z_FINISH ? ret == Z_STREAM_END : (s.avail_in == 0 && s.avail_out != 0)) break;
+        }
+        return produced;
+    }
+
+    void init(z_stream& s) const
+    {
+        s = z_stream();
+        if (deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("deflateInit2 failed");
+    }
+
+    size_t compressed_size(std::string_view x, std::string_view y) const override
+    {
+        z_stream s;
+        init(s);
+        size_t total = feed(s, x, Z_NO_FLUSH) + feed(s, y, Z_FINISH);
+        deflateEnd(&s);
+        return total;
+    }
+
+    std::unique_ptr< QSearchPrimedCompressor > prime(std::string_view x) const override
+    {
+        std::unique_ptr< PrimedDeflate > p( new PrimedDeflate() );
+        init(p->s);
+        p->x_size = feed(p->s, x, Z_NO_FLUSH);
+        return p;
+    }
+};
+
+size_t PrimedDeflate::compressed_size(std::string_view y) const
+{
+    z_stream c = z_stream();
+    if (deflateCopy(&c, &s) != Z_OK) throw std::runtime_error("deflateCopy failed");
+    size_t total = x_size + DeflateCompressor::feed(c, y, Z_FINISH);
+    deflateEnd(&c);
+    return total;
+}
+#endif
+
+#ifdef QSEARCH_HAVE_BZIP2
+struct Bzip2Compressor : public QSearchCompressor {
+    std::string name() const override { return "bzip2"; }
+
+    static size_t feed(bz_stream& s, std::string_view in, int action)
+    {
+        char out[SCRATCH_SIZE];
+        size_t produced = 0;
+        s.next_in = (char*)in.data();
+        s.avail_in = (unsigned int)in.size();
+        for (;;) {
+            s.next_out = out;
+            s.avail_out = sizeof(out);
+            int ret = BZ2_bzCompress(&s, action);
+            if (ret < 0) throw std::runtime_error("BZ2_bzCompress failed");
+            produced += sizeof(out) - s.avail_out;
+            if (action == BZ_FINISH ? ret == BZ_STREAM_END : (s.avail_in == 0 && s.avail_out != 0)) break;
+        }
+        return produced;
+    }
+
+    size_t compressed_size(std::string_view x, std::string_view y) const override
+    {
+        bz_stream s = bz_stream();
+        if (BZ2_bzCompressInit(&s, 9, 0, 0) != BZ_OK) throw std::runtime_error("BZ2_bzCompressInit failed");
+        size_t total = feed(s, x, BZ_RUN) + feed(s, y, BZ_FINISH);
+        BZ2_bzCompressEnd(&s);
+        return total;
+    }
+};
+#endif
+
+#ifdef QSEARCH_HAVE_LZMA
+struct XzCompressor : public QSearchCompressor {
+    std::string name() const override { return "xz"; }
+
+    static size_t feed(lzma_stream& s, std::string_view in, lzma_action action)
+    {
+        uint8_t out[SCRATCH_SIZE];
+        size_t produced = 0;
+        s.next_in = (const uint8_t*)in.data();
+        s.avail_in = in.size();
+        for (;;) {
+            s.next_out = out;
+            s.avail_out = sizeof(out);
+            lzma_ret ret = lzma_code(&s, action);
+            if (ret != LZMA_OK && ret != LZMA_STREAM_END) throw std::runtime_error("lzma_code failed");
+            produced += sizeof(out) - s.avail_out;
+            if (action == LZMA_FINISH ? ret == LZMA_STREAM_END : (s.avail_in == 0 && s.avail_out != 0)) break;
+        }
+        return produced;
+    }
+
+    size_t compressed_size(std::string_view x, std::string_view y) const override
+    {
+        // preset 6, but with a dictionary no larger than the input: the encoder's memory (and
+        // set-up time) grows with it, and a bigger one cannot find more matches
+        lzma_options_lzma opt;
+        lzma_lzma_preset(&opt, 6);
+        opt.dict_size = std::min< uint32_t >( opt.dict_size, std::max< size_t >( LZMA_DICT_SIZE_MIN, x.size() + y.size() ) );
+        lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &opt }, { LZMA_VLI_UNKNOWN, NULL } };
+
+        lzma_stream s = LZMA_STREAM_INIT;
+        if (lzma_stream_encoder(&s, filters, LZMA_CHECK_NONE) != LZMA_OK) throw std::runtime_error("lzma_stream_encoder failed");
+        size_t total = feed(s, x, LZMA_RUN) + feed(s, y, LZMA_FINISH);
+        lzma_end(&s);
+        return total;
+    }
+};
+#endif
+
+#ifdef QSEARCH_HAVE_ZSTD
+struct ZstdCompressor : public QSearchCompressor {
+    std::string name() const override { return "zstd"; }
+
+    static size_t feed(ZSTD_CCtx* c, std::string_view in, ZSTD_EndDirective mode)
+    {
+        char out[SCRATCH_SIZE];
+        size_t produced = 0;
+        ZSTD_inBuffer input = { in.data(), in.size(), 0 };
+        for (;;) {
+            ZSTD_outBuffer output = { out, sizeof(out), 0 };
+            size_t left = ZSTD_compressStream2(c, &output, &input, mode);
+            if (ZSTD_isError(left)) throw std::runtime_error("ZSTD_compressStream2 failed");
+            produced += output.pos;
+            if (mode == ZSTD_e_end ? left == 0 : input.pos == input.size) break;
+        }
+        return produced;
+    }
+
+    // contexts are expensive to set up, every thread keeps one
+    static ZSTD_CCtx* context()
+    {
+        static thread_local std::unique_ptr< ZSTD_CCtx, size_t (*)(ZSTD_CCtx*) > c( ZSTD_createCCtx(), ZSTD_freeCCtx );
+        ZSTD_CCtx_reset(c.get(), ZSTD_reset_session_and_parameters);
+        return c.get();
+    }
+
+    size_t compressed_size(std::string_view x, std::string_view y) const override
+    {
+        ZSTD_CCtx* c = context();
+        return feed(c, x, ZSTD_e_continue) + feed(c, y, ZSTD_e_end);
+    }
+
+    // no prime(): zstd cannot copy a stream part way through a frame, and a dictionary of x
+    // would change what C(xy) means, so every pair is compressed from the start
+};
+#endif
+
+std::unique_ptr< QSearchCompressor > QSearchCompressor::create(const std::string& name)
+{
+#ifdef QSEARCH_HAVE_ZLIB
+    if (name == "gzip") return std::unique_ptr< QSearchCompressor >( new DeflateCompressor("gzip", 15 + 16) );
+    if (name == "zlib") return std::unique_ptr< QSearchCompressor >( new DeflateCompressor("zlib", 15) );
+#endif
+#ifdef QSEARCH_HAVE_BZIP2
+    if (name == "bzip2") return std::unique_ptr< QSearchCompressor >( new Bzip2Compressor() );
+#endif
+#ifdef QSEARCH_HAVE_LZMA
+    if (name == "xz") return std::unique_ptr< QSearchCompressor >( new XzCompressor() );
+#endif
+#ifdef QSEARCH_HAVE_ZSTD
+    if (name == "zstd") return std::unique_ptr< QSearchCompressor >( new ZstdCompressor() );
+#endif
+    return nullptr;
+}
+
+StringList QSearchCompressor::available()
+{
+    StringList names;
+    for (auto name : { "gzip", "zlib", "bzip2", "xz", "zstd" })
+        if (create(name)) names.push_back(name);
+    return names;
+}
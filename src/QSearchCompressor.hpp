@@ -0,0 +1,36 @@
+#ifndef __QSEARCH_COMPRESSOR_HPP
+#define __QSEARCH_COMPRESSOR_HPP
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <cstddef>
+#include "StringTools.hpp"
+
+// A compressor that has already been fed x, so C(xy) can be found for many y without going
+// over x again. Read-only once made: several threads may use one at the same time.
+struct QSearchPrimedCompressor {
+    virtual ~QSearchPrimedCompressor() {}
+    // bytes taken by x followed by y
+    virtual size_t compressed_size(std::string_view y) const = 0;
+};
+
+// A compression algorithm as NCD uses it: only the compressed size is wanted, so output goes
+// to a small scratch buffer and is thrown away. Every call sets up its own stream, so one
+// compressor may be used from several threads at once. Default levels are used throughout.
+struct QSearchCompressor {
+    virtual ~QSearchCompressor() {}
+    virtual std::string name() const = 0;
+    // bytes taken by x followed by y, compressed as one stream
+    virtual size_t compressed_size(std::string_view x, std::string_view y = std::string_view()) const = 0;
+    // compress x once and keep the state; x must outlive the result. Compressors that cannot
+    // save their state just keep x and compress both on every call.
+    virtual std::unique_ptr< QSearchPrimedCompressor > prime(std::string_view x) const;
+
+    // "gzip" (deflate with the gzip framing the browser uses), "zlib", "bzip2", "xz" or "zstd".
+    // Null when the library was not found at build time.
+    static std::unique_ptr< QSearchCompressor > create(const std::string& name);
+    static StringList available();
+};
+
+#endif // __QSEARCH_COMPRESSOR_HPP
@@ -2,11 +2,13 @@
 #include "QSearchNeighborList.hpp"
 #include <cassert>
 
-QSearchConnectedNode::QSearchConnectedNode( const unsigned int& branches ) : node_branch(branches), done(0)
+QSearchConnectedNode::QSearchConnectedNode() : parent_branch(-1), enter(0)
     {
-        for(int i = 0; i<3; i++) {
-            connections[i] = 0;
+        for(int i = 0; i < 3; i++) {
+            connections[i] = -1;
             leaf_count[i] = 0;
+            branch_enter[i] = 0;
+            branch_span[i] = 0;
         }
     }
 
@@ -18,126 +20,70 @@ inline int QSearchConnectedNode::find_branch(const int &to) {
     return -1;
 }
 
-QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTree &clt) 
-    : map(clt.total_node_count, QSearchConnectedNode(clt.total_node_count))
+template<class M> QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTreeT<M> &clt) 
+    : map(clt.total_node_count)
 {
     const int node_count = clt.total_node_count;
-    const int leaf_count = (node_count + 2)/2;
-       
-    for (int i = 0; i < node_count; ++i) {
-        map[i].done = 0;
-        for (int j = 0; j < 3; ++j) {
-            map[i].connections[j] = -1;
-            map[i].leaf_count[j] = 0;
-        }
-        
-        if (i < leaf_count) {
-            for (int j=0; j < node_count; ++j) map[i].node_branch[j] = 0;
-            map[i].leaf_count[0] = leaf_count - 1;
-            map[i].done = 1;
-        } else {
-            for (int j = 0; j < node_count; ++j) map[i].node_branch[j] = -1;
-        } 
-    }
-     
-    // set connections (construct tree)
-    //for( auto& cln : clt.n) {
+    int leaf_count = 0;
+
     for (int i = 0; i < node_count; ++i) {
         const QSearchNeighborList& cln = clt.n[i];
-        // add to connected nodes
-        //for( auto& node : cln.n ) {
-        for (int j = 0; j < cln.size(); ++j) {
-            unsigned int node = cln[j];
-            // std::cout << "QSearchConnectedNodeMap::QSearchConnectedNodeMap() node = " << node << "\n";
-            // find unfilled branch
-            int branch = map[node].find_branch(-1);
-            map[node].connections[branch] = i; // set connection
-            
-            if (i < leaf_count) {
-                map[node].leaf_count[branch] = 1; // set leaf
-            }
-            map[node].node_branch[i] = branch; // leaf can be found in branch
-
-            // set connection back to this node
-            branch = map[i].find_branch(-1);
-            map[i].connections[branch] = node;
-            map[i].node_branch[node] = branch;
-        }
+        assert(cln.size() == 1 || cln.size() == 3);
+        for (int j = 0; j < cln.size(); ++j) map[i].connections[j] = cln[j];
+        if (cln.size() == 1) leaf_count++;
     }
 
-    // every iteration, this loop progresses by at least finishing one node. Worst case is n^3 (for 'linear' trees)
-    for (;;) {
-        for (int i = leaf_count; i < node_count; ++i) {
-            
-            if (map[i].done) continue; // nothing to be done here
-                        
-            for (int j = 0; j < 3; ++j) {
-                int node = map[i].connections[j];
-                if (map[node].done) continue; 
+    // Walk the tree once from node 0. Nodes get their enter number on the way down; on the way
+    // up every node knows how many nodes and leaves hang below it, which fills in the interval
+    // and the leaf count of the branch leading to it.
+    std::vector< int > subtree_leaves(node_count, 0);
+    std::vector< unsigned int > subtree_size(node_count, 1);
+    std::vector< int > stack;
+    std::vector< int > next_branch(node_count, 0);
+    unsigned int counter = 0;
 
-                int branch = map[node].find_branch(i);
-                if (map[node].leaf_count[branch] == 0) {
-                    int first = (3 + j-1) % 3;
-                    int second = (j + 1) % 3;
-                    if (map[i].leaf_count[first] != 0 && map[i].leaf_count[second] != 0) {
-                        map[node].leaf_count[branch] = map[i].leaf_count[first] + map[i].leaf_count[second];
-                        
-                        // set the nodes in the other
-                        int k;
-                        for (k = 0; k < node_count; ++k) {
-                            // node present in one of the two branches pointing away from this
-                            int node_present = k==i || map[i].node_branch[k] == first || map[i].node_branch[k] == second;
-                            
-                            if (node_present && map[node].node_branch[k] == -1) map[node].node_branch[k] = branch;
-                        }
-                    }
-                }
-            }
+    map[0].enter = counter++;
+    stack.push_back(0);
+    while (!stack.empty()) {
+        int node = stack.back();
+        QSearchConnectedNode& cn = map[node];
+        if (next_branch[node] < 3) {
+            int j = next_branch[node]++;
+            int child = cn.connections[j];
+            if (child == -1 || j == cn.parent_branch) continue;
+            QSearchConnectedNode& cc = map[child];
+            cc.parent_branch = cc.find_branch(node);
+            cc.enter = counter++;
+            stack.push_back(child);
+            continue;
         }
-        
-        int all_done = 1;
-        for (int i = leaf_count; i < node_count; ++i) {
-            if (map[i].done) continue;
-            
-            // we are done when all entries are set for this node, AND there are no pending assignments to neighbours
-
-            // are all entries set for this node?
-            int entry_completed = 1;
-            for (int j = 0; j < 3; ++j) {
-                if (map[i].leaf_count[j] == 0) { 
-                    entry_completed = 0;
-                    break;
-                }
-            }
-
-            if (entry_completed) {
-                // are there pending assignments? (we could do the assignments here, but that would duplicate code)
-                int done = 1;
-                for (int j = 0; j < 3; ++j) {
-                    int node = map[i].connections[j];
-                    if (node < leaf_count) continue;
-                    // find connection
-                    int branch = map[node].find_branch(i);
-                    if (map[node].leaf_count[branch] == 0) {
-                        done = 0;
-                        break;
-                    }
-                }
-                
-                map[i].done = done;
-                if (!done) all_done = 0;
-            } else {
-                all_done = 0;
-            }
+        stack.pop_back();
+        if (clt.n[node].size() == 1) subtree_leaves[node] += 1;
+        if (cn.parent_branch != -1) {
+            int parent = cn.connections[cn.parent_branch];
+            QSearchConnectedNode& pn = map[parent];
+            int branch = pn.find_branch(node);
+            pn.branch_enter[branch] = cn.enter;
+            pn.branch_span[branch] = subtree_size[node];
+            pn.leaf_count[branch] = subtree_leaves[node];
+            subtree_leaves[parent] += subtree_leaves[node];
+            subtree_size[parent] += subtree_size[node];
         }
-        
-        // everything is set and accounted for
-        if (all_done) break; 
-
     }
+    assert(counter == (unsigned int)node_count);
+
+    // the parent branch holds every leaf not below the node
+    for (int i = 0; i < node_count; ++i)
+        if (map[i].parent_branch != -1)
+            map[i].leaf_count[ map[i].parent_branch ] = leaf_count - subtree_leaves[i];
 }
 
-QSearchConnectedNode  QSearchConnectedNodeMap::operator[](const unsigned int &i) const
+template QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTreeT< QMatrix<double> > &clt);
+template QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTreeT< QMatrix<float> > &clt);
+template QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTreeT< QSymmetricMatrix<double> > &clt);
+template QSearchConnectedNodeMap::QSearchConnectedNodeMap(const QSearchTreeT< QSymmetricMatrix<float> > &clt);
+
+const QSearchConnectedNode& QSearchConnectedNodeMap::operator[](const unsigned int &i) const
 { 
     assert(i<map.size());
     return map[i];
@@ -148,6 +94,3 @@ QSearchConnectedNode& QSearchConnectedNodeMap::operator[](const unsigned int &i)
     assert(i<map.size());
     return map[i];
 }
-
-inline unsigned int QSearchConnectedNodeMap::next_node(const unsigned int &from, const unsigned int &to)
-    { return map[from].connections[ map[from].node_branch[to] ]; }
@@ -1,26 +1,47 @@
+#ifndef __QSEARCH_CONNECTED_NODE_HPP
+#define __QSEARCH_CONNECTED_NODE_HPP
+
 #include <vector>
 #include "QSearchTree.hpp"
 
 struct QSearchConnectedNode {
-    int done;
     int connections[3];
     int leaf_count[3];
-    std::vector< char > node_branch; // pointing in the direction where to find a node (?)
+    int parent_branch;              // branch leading back to the root, -1 at the root
+    unsigned int enter;             // position in the depth-first (Euler tour) order
+    // nodes behind child branch j have enter in [branch_enter[j], branch_enter[j] + branch_span[j]);
+    // branch_span is 0 for the parent branch and unused branches
+    unsigned int branch_enter[3];
+    unsigned int branch_span[3];
 
     int find_branch(const int& to);
 
-    QSearchConnectedNode( const unsigned int& branches );
+    QSearchConnectedNode();
 };
 
+// Rooted view of a QSearchTree built by one depth-first walk. The branch of any node leading
+// to any other node is answered in constant time from the Euler tour intervals, so nothing
+// of size node_count^2 is stored.
 struct QSearchConnectedNodeMap {
     std::vector<QSearchConnectedNode> map;
 
-    QSearchConnectedNodeMap( const QSearchTree& clt ); // replaces init_node_map()
+    template<class M> QSearchConnectedNodeMap( const QSearchTreeT<M>& clt ); // replaces init_node_map()
 
-    QSearchConnectedNode  operator [](const unsigned int& i) const; 
-    QSearchConnectedNode& operator [](const unsigned int& i); 
+    const QSearchConnectedNode& operator [](const unsigned int& i) const;
+    QSearchConnectedNode&       operator [](const unsigned int& i);
 
-    unsigned int next_node(const unsigned int& from, const unsigned int& to);
-};
+    // branch of node 'from' pointing in the direction of node 'to', -1 if they are the same node
+    int node_branch(const unsigned int& from, const unsigned int& to) const {
+        if (from == to) return -1;
+        const QSearchConnectedNode& f = map[from];
+        const unsigned int t = map[to].enter;
+        for (int j = 0; j < 3; ++j)
+            if (t - f.branch_enter[j] < f.branch_span[j]) return j;
+        return f.parent_branch;
+    }
 
+    unsigned int next_node(const unsigned int& from, const unsigned int& to) const
+        { return map[from].connections[ node_branch(from, to) ]; }
+};
 
+#endif // __QSEARCH_CONNECTED_NODE_HPP
@@ -1,10 +1,15 @@
 
 #include "QSearchFullTree.hpp"
+#include "QSearchConnectedNode.hpp"
 #include "RandTools.hpp"
+#include "QSearchThreadPool.hpp"
+#include "QSearchTelemetry.hpp"
 
 #include <cassert>
+#include <cmath>
+#include <atomic>
 
-FullNode::FullNode( const unsigned int& size ) : node_branch( size ) 
+FullNode::FullNode()
 {
     for( int i = 0; i < 3; i++ ) {
         connections[i] = 0;
@@ -27,13 +32,13 @@ int FullNode::find_branch(int to) {
     return -1;
 }
 
-unsigned int QSearchFullTree::next_node(const unsigned int& from, const unsigned int& to) {
-    return map[from].connections[ (int) map[from].node_branch[to] ];
+template<class M> unsigned int QSearchFullTreeT<M>::next_node(const unsigned int& from, const unsigned int& to) {
+    return map[from].connections[ map.branch(from, to) ];
 }
 
 static inline double npairs(double n) { return n * (n-1)/2; }
 
-void QSearchFullTree::set_score() {
+template<class M> void QSearchFullTreeT<M>::set_score() {
     // calculate the score
     raw_score = 0;
     int i;
@@ -44,267 +49,181 @@ void QSearchFullTree::set_score() {
     }
 }
 
-QSearchFullTree::QSearchFullTree(const QSearchTree& clt) : dm( clt.dm ), map( clt.total_node_count ), 
-    node_count( clt.total_node_count ), leaf_count( clt.dm.dim )
+template<class M> QSearchFullTreeT<M>::QSearchFullTreeT(const QSearchTreeT<M>& clt) : dm( clt.dm ), map( clt.total_node_count ), 
+    node_count( clt.total_node_count ), leaf_count( clt.dm.dim ), pair_next( PAIR_BATCH )
 { 
     unsigned int i,j; 
     
-    NodeList todo(node_count - leaf_count);
- 
-    // build initial node map
+    reserve_scratch();
+    // score() normalizes by the quartet bounds; no tree may have computed them for dm yet
+    if (!dm.quartet_bounds) dm.quartet_bounds = quartet_bounds(dm);
+
+    // connections, leaf counts and branch table all come from one walk over the tree
+    QSearchConnectedNodeMap cmap(clt);
     for (i = 0; i < node_count; ++i) {
-        FullNode& node = map[i];
-        
+        const QSearchConnectedNode& cn = cmap[i];
         for (j = 0; j < 3; ++j) {
-            map[i].connections[j] = -1;
-            map[i].leaf_count[j] = 0;
+            map[i].connections[j] = cn.connections[j];
+            map[i].leaf_count[j] = cn.leaf_count[j];
             map[i].dist[j] = 0;
         }
-
-        if (i < leaf_count) {
-            for (j=0; j < node_count; ++j) node.node_branch[j] = 0;
-            node.leaf_count[0] = leaf_count - 1;
-        } else {
-            for (j = 0; j < node_count; ++j) node.node_branch[j] = -1;
-            todo[i - leaf_count] = i;
-        } 
-    }
-     
-    // set connections (construct tree)
-    for (i = 0; i < node_count; ++i) {
-
-        const QSearchNeighborList& cln = clt.n[i];
-        // add to connected nodes
-        for (j = 0; j < cln.size(); ++j) {
-            unsigned int node = cln[j];
-
-            // find unfilled branch
-            int branch = map[node].find_branch(-1);
-            map[node].connections[branch] = i; // set connection
-            
-            if (i < leaf_count) {
-                map[node].leaf_count[branch] = 1; // set leaf
-            }
-            map[node].node_branch[i] = branch; // leaf can be found in branch
-
-            // set connection back to this node
-            branch = map[i].find_branch(-1);
-            map[i].connections[branch] = node;
-            map[i].node_branch[node] = branch;
+        for (unsigned int k = 0; k < node_count; ++k) {
+            int branch = cmap.node_branch(i, k);
+            if (branch == -1) branch = i < leaf_count ? 0 : FullNodeList::BRANCH_UNSET;
+            map.set_branch(i, k, branch);
         }
     }
-    
-    // every iteration, this loop progresses by at least finishing one node. Worst case is n^3 (for 'linear' trees)
-    while (todo.size() > 0) {
-        for (unsigned int i = 0; i < todo.size(); ++i) {
-            
-            unsigned int this_node = todo[i]; 
-                        
-            for (j = 0; j < 3; ++j) {
-                unsigned int connected_node = map[this_node].connections[j];
-                unsigned int branch = map[connected_node].find_branch(this_node);
-
-                if (map[connected_node].leaf_count[branch] == 0) {
-                    unsigned int first = (3 + j-1) % 3;
-                    unsigned int second = (j + 1)  % 3;
-                    if (map[this_node].leaf_count[first] != 0 && map[this_node].leaf_count[second] != 0) {
-                        map[connected_node].leaf_count[branch] = map[this_node].leaf_count[first] + map[this_node].leaf_count[second];
-                        
-                        // set the node_branch information
-                        unsigned int k;
-                        for (k = 0; k < node_count; ++k) {
-                            // node present in one of the two branches pointing away from this
-                            unsigned int node_present = k==this_node || map[this_node].node_branch[k] == first || map[this_node].node_branch[k] == second;
-                            
-                            if (node_present) map[connected_node].node_branch[k] = branch;
-                        }
-                    }
-                }
-            }
-        }
         
-        for (i = 0; i < todo.size(); ++i) {
-            
-            unsigned int this_node = todo[i];
-             
-            // we are done when all entries are set for this node, AND there are no pending assignments to neighbours
-
-            // are all entries set for this node?
-            for (j = 0; j < 3; ++j) {
-                if (map[this_node].leaf_count[j] == 0) { 
-                    break;
-                }
-            }
+    refresh();
+}
 
-            // are there pending assignments? (we could do the assignments here, but that would duplicate code)
-            int done = 1;
-            for (j = 0; j < 3; ++j) {
-                if (this_node < leaf_count) continue;
-                unsigned int connected_node = map[this_node].connections[j];
-                // find connection
-                unsigned int branch = map[connected_node].find_branch(this_node);
-                if (map[connected_node].leaf_count[branch] == 0) {
-                    done = 0;
-                    break;
-                }
-            }
-            
-            if (done) {
-                todo.erase( todo.begin() + i );
-                --i;
-            }
-        }
-    }
-        
-    unsigned int k; 
-    // now fill in the distances
-    for (i=leaf_count; i < node_count; ++i) {
-        for (j = 0; j < leaf_count; ++j) {
-            for (k = j+1; k < leaf_count; ++k) {
-
-                int b1 = map[i].node_branch[j];
-                int b2 = map[i].node_branch[k];              
-                
-                if (b1 == b2) continue;
-
-                int b3 = 3 - b1 - b2;
-                map[i].dist[b3] += dm[j][k];
+template<class M> void QSearchFullTreeT<M>::reserve_scratch()
+{
+    scratch_a.reserve(node_count);
+    scratch_b.reserve(node_count);
+    leaf_sum_a.resize(leaf_count);
+    leaf_sum_b.resize(leaf_count);
+    leaf_side.resize(leaf_count);
+    path.reserve(node_count);
+    walk_stack.reserve(2 * node_count);
+    move_log.reserve(64);
+}
+
+template<class M> void QSearchFullTreeT<M>::refresh()
+{
+    // per internal node, bucket the leaves by branch and add up the pairs across each two branches
+    std::vector< unsigned int > columns(leaf_count);
+    for (unsigned int i = leaf_count; i < node_count; ++i) {
+        int start[4] = { 0, map[i].leaf_count[0], map[i].leaf_count[0] + map[i].leaf_count[1], (int)leaf_count };
+        int fill[3] = { start[0], start[1], start[2] };
+        for (unsigned int j = 0; j < leaf_count; ++j) columns[ fill[ map.branch(i, j) ]++ ] = j;
+
+        for (int b3 = 0; b3 < 3; ++b3) {
+            int b1 = (b3 + 1) % 3, b2 = (b3 + 2) % 3;
+            double d = 0.0;
+            for (int j = start[b1]; j < start[b1 + 1]; ++j) {
+                const unsigned int cj = columns[j];
+                for (int k = start[b2]; k < start[b2 + 1]; ++k) d += dm.at( cj, columns[k] );
             }
+            map[i].dist[b3] = d;
         }
     }
     
     set_score();
 }
     
-void QSearchFullTree::random_pair(unsigned int& a, unsigned int& b) 
+template<class M> void QSearchFullTreeT<M>::random_pair(unsigned int& a, unsigned int& b, QSearchRandom& rng) 
 {
-    a = rand_range(0, node_count-1);
-    b = a;
-    
-    while (b == a || move_to(a, b) == b ) b = rand_range(0, node_count-1);
+    do {
+        if (pair_next == PAIR_BATCH) {
+            rng.fill_pairs(pair_a, pair_b, PAIR_BATCH, node_count);
+            pair_next = 0;
+        }
+        a = pair_a[pair_next];
+        b = pair_b[pair_next];
+        ++pair_next;
+    } while (move_to(a, b) == b);   // neighbours cannot be swapped
 }
 
-bool QSearchFullTree::can_swap(const unsigned int& a, const unsigned int& b) 
+template<class M> bool QSearchFullTreeT<M>::can_swap(const unsigned int& a, const unsigned int& b) 
 {
    if (a == b) return false; // no point in doing anything
     
-   unsigned int interiorA = map[a].connections[ map[a].node_branch[b] ];
-   unsigned int interiorB = map[b].connections[ map[b].node_branch[a] ];
+   unsigned int interiorA = map[a].connections[ map.branch(a, b) ];
+   unsigned int interiorB = map[b].connections[ map.branch(b, a) ];
    
    if (interiorA == interiorB || interiorA == b) return false; // swap does not change score
    return true;
 }
 
-void QSearchFullTree::swap_nodes(const unsigned int& a, const unsigned int& b) 
+// npairs-weighted sum of the three branch distances of a node
+static inline double node_score(const int lc[3], const double dist[3])
+{
+    return npairs(lc[0]) * dist[0] + npairs(lc[1]) * dist[1] + npairs(lc[2]) * dist[2];
+}
+
+template<class M> void QSearchFullTreeT<M>::swap_nodes(const unsigned int& a, const unsigned int& b) 
 {
-   NodeList aNodes, bNodes;
+   QSEARCH_SAMPLE_PHASE(PHASE_SWAP_NODES);
+   NodeList& aNodes = scratch_a;
+   NodeList& bNodes = scratch_b;
 
    if (a == b) return; // no point in doing anything
     
-   unsigned int interiorA = map[a].connections[ map[a].node_branch[b] ];
-   unsigned int interiorB = map[b].connections[ map[b].node_branch[a] ];
+   unsigned int interiorA = map[a].connections[ map.branch(a, b) ];
+   unsigned int interiorB = map[b].connections[ map.branch(b, a) ];
    
    if (interiorA == interiorB || interiorA == b) return; // swap does not change score
 
-   unsigned int aToInteriorBranch = map[a].node_branch[interiorA];
-   unsigned int bToInteriorBranch = map[b].node_branch[interiorB];
+   unsigned int aToInteriorBranch = map.branch(a, interiorA);
+   unsigned int bToInteriorBranch = map.branch(b, interiorB);
    
-   unsigned int countA = leaf_count - map[a].leaf_count[aToInteriorBranch];
-   unsigned int countB = leaf_count - map[b].leaf_count[bToInteriorBranch];
+   int countA = leaf_count - map[a].leaf_count[aToInteriorBranch];
+   int countB = leaf_count - map[b].leaf_count[bToInteriorBranch];
    
-   unsigned int interiorToABranch = map[interiorA].node_branch[a];
-   unsigned int interiorToBBranch = map[interiorB].node_branch[b];
+   unsigned int interiorToABranch = map.branch(interiorA, a);
+   unsigned int interiorToBBranch = map.branch(interiorB, b);
      
-   // loop over internal nodes, swap node_branches from A <-> B
-   unsigned int node = interiorA;
-   
-   //printf("Score before %f\n", raw_score);
-    
-   // store the nodes that need to be updated
-   int i,j;
+   // store the nodes that need to be updated, and sum the distances of every leaf to the
+   // leaves of A (ta) and of B (tb)
+   double* ta = leaf_sum_a.data();
+   double* tb = leaf_sum_b.data();
+   std::fill(ta, ta + leaf_count, 0.0);
+   std::fill(tb, tb + leaf_count, 0.0);
+   unsigned int i;
+   aNodes.clear();
+   bNodes.clear();
    for (i = 0; i < node_count; ++i) {
-        if (i == a || map[a].node_branch[i] != aToInteriorBranch) {
+        if (i == a || map.branch(a, i) != aToInteriorBranch) {
             aNodes.push_back(i);
+            if (i < leaf_count) dm.add_row(ta, i);
         }
-        if (i == b || map[b].node_branch[i] != bToInteriorBranch) {
+        if (i == b || map.branch(b, i) != bToInteriorBranch) {
             bNodes.push_back(i);
+            if (i < leaf_count) dm.add_row(tb, i);
         }
    }
 
-
-   // move towards B 
-   while (node != b) {
-
-        int aBranch = map[node].node_branch[a];
-        int bBranch = map[node].node_branch[b];
+   // The leaves off the path hang in the subtrees C_0..C_k of the path nodes. At node m the
+   // a side is A plus C_<m and the b side B plus C_>m, so prefix sums over the hanging
+   // subtrees give every distance update in O(1):
+   //   dist[c] += d(C_<m,A) + d(C_>m,B) - d(C_<m,B) - d(C_>m,A),  dist[a] += d(A,C_m) - d(B,C_m),  dist[b] -= the same
+   collect_path(interiorA, b, a, b, ta, tb);
+   double totalA = 0, totalB = 0;
+   for (auto& step : path) { totalA += step.hang_a; totalB += step.hang_b; }
+
+   double beforeA = 0, beforeB = 0;
+   for (auto& step : path) {
+        unsigned int node = step.node;
+        int aBranch = step.a_branch;
+        int bBranch = step.b_branch;
         int cBranch = 3 - aBranch - bBranch;
+        FullNode& fn = map[node];
+        double afterA = totalA - beforeA - step.hang_a;
+        double afterB = totalB - beforeB - step.hang_b;
         
-        raw_score -= npairs(map[node].leaf_count[0]) * map[node].dist[0];
-        raw_score -= npairs(map[node].leaf_count[1]) * map[node].dist[1];
-        raw_score -= npairs(map[node].leaf_count[2]) * map[node].dist[2];
-        
-        //std::cout << "\nNode " << node << "\n";
-        //std::cout << "Score now " << raw_score << ", distances " << map[node].dist[0] << " " << map[node].dist[1] << " " << map[node].dist[2] << "\n";
+        raw_score -= node_score(fn.leaf_count, fn.dist);
         
-        map[node].leaf_count[aBranch] += countB - countA;
-        map[node].leaf_count[bBranch] += countA - countB;
-       
-        // update the branches that point to elements from A 
-        for (i = 0; i < aNodes.size(); ++i) {
-            unsigned int aNode = aNodes[i];
-            assert(map[node].node_branch[aNode] == aBranch);
-            map[node].node_branch[aNode] = bBranch;
-           
-            // update distances 
-            if (aNode < leaf_count) { // it's  a leaf
-                for (j = 0; j < leaf_count; ++j) {
-                    if (aNode==j) continue;
-                    
-                    double d = dm[aNode][j];
-
-                    if (map[node].node_branch[j] == cBranch) {
-                        map[node].dist[aBranch] += d;
-                        map[node].dist[bBranch] -= d;
-                    } else if (map[node].node_branch[j] == aBranch) {
-                        map[node].dist[cBranch] += d;
-                    } else {
-                        map[node].dist[cBranch] -= d;
-                    }
-                }
-            }
-        } 
-
-            
-        // update the branches that point to elements from B
-        for (i = 0; i < bNodes.size(); ++i) {
-            unsigned int bNode = bNodes[i];
-            assert(map[node].node_branch[bNode] == bBranch);
-            map[node].node_branch[bNode] = aBranch;
-                
-            if (bNode < leaf_count) { // it's  a leaf
-                for (j = 0; j < leaf_count; ++j) {
-                    if (bNode==j) continue;
-                    
-                    double d = dm[bNode][j];
-
-                    if (map[node].node_branch[j] == cBranch) {
-                        map[node].dist[bBranch] += d;
-                        map[node].dist[aBranch] -= d;
-                    } else if (map[node].node_branch[j] == bBranch) {
-                        map[node].dist[cBranch] += d;
-                    } else {
-                        map[node].dist[cBranch] -= d;
-                    }
-                }
-            }
+        fn.leaf_count[aBranch] += countB - countA;
+        fn.leaf_count[bBranch] += countA - countB;
+        fn.dist[cBranch] += beforeA + afterB - beforeB - afterA;
+        fn.dist[aBranch] += step.hang_a - step.hang_b;
+        fn.dist[bBranch] += step.hang_b - step.hang_a;
+
+        raw_score += node_score(fn.leaf_count, fn.dist);
+
+        // the elements from A are now reached through the b branch and the other way round
+        for (auto aNode : aNodes) {
+            assert(map.branch(node, aNode) == aBranch);
+            map.set_branch(node, aNode, bBranch);
+        }
+        for (auto bNode : bNodes) {
+            assert(map.branch(node, bNode) == bBranch);
+            map.set_branch(node, bNode, aBranch);
         }
 
-        raw_score += npairs(map[node].leaf_count[0]) * map[node].dist[0];
-        raw_score += npairs(map[node].leaf_count[1]) * map[node].dist[1];
-        raw_score += npairs(map[node].leaf_count[2]) * map[node].dist[2];
-        
-        
-        node = map[node].connections[ bBranch ];
+        beforeA += step.hang_a;
+        beforeB += step.hang_b;
    }
      
    // swap directions for A and B
@@ -316,29 +235,354 @@ void QSearchFullTree::swap_nodes(const unsigned int& a, const unsigned int& b)
    map[b].connections[ bToInteriorBranch ] = interiorA;
 }
 
-std::unique_ptr< QSearchTree > QSearchFullTree::to_searchtree() 
+template<class M> void QSearchFullTreeT<M>::collect_path(unsigned int from, const unsigned int& to, const unsigned int& a, const unsigned int& b,
+                                   const double* ta, const double* tb)
+{
+    path.clear();
+    for (unsigned int node = from; node != to; ) {
+        FullPathStep step;
+        step.node = node;
+        step.a_branch = map.branch(node, a);
+        step.b_branch = map.branch(node, b);
+        step.hang_a = step.hang_b = 0.0;
+
+        // depth first over the hanging subtree, as (node, parent) pairs
+        walk_stack.clear();
+        walk_stack.push_back( map[node].connections[ 3 - step.a_branch - step.b_branch ] );
+        walk_stack.push_back( node );
+        while (!walk_stack.empty()) {
+            unsigned int parent = walk_stack.back(); walk_stack.pop_back();
+            unsigned int v = walk_stack.back(); walk_stack.pop_back();
+            if (v < leaf_count) {
+                step.hang_a += ta[v];
+                if (tb) step.hang_b += tb[v];
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                unsigned int w = map[v].connections[k];
+                if (w == parent) continue;
+                walk_stack.push_back(w);
+                walk_stack.push_back(v);
+            }
+        }
+        path.push_back(step);
+        node = map[node].connections[ step.b_branch ];
+    }
+}
+
+template<class M> double QSearchFullTreeT<M>::evaluate_swap(const unsigned int& a, const unsigned int& b)
+{
+    QSEARCH_SAMPLE_PHASE(PHASE_EVALUATE);
+    if (a == b) return 0.0;
+    unsigned int interiorA = map[a].connections[ map.branch(a, b) ];
+    unsigned int interiorB = map[b].connections[ map.branch(b, a) ];
+    if (interiorA == interiorB || interiorA == b) return 0.0; // swap does not change score
+
+    unsigned int aToInteriorBranch = map.branch(a, interiorA);
+    unsigned int bToInteriorBranch = map.branch(b, interiorB);
+    int countA = leaf_count - map[a].leaf_count[aToInteriorBranch];
+    int countB = leaf_count - map[b].leaf_count[bToInteriorBranch];
+
+    // ta[j], tb[j]: distance from leaf j to all leaves below a (the set A) and below b (B)
+    double* ta = leaf_sum_a.data();
+    double* tb = leaf_sum_b.data();
+    std::fill(ta, ta + leaf_count, 0.0);
+    std::fill(tb, tb + leaf_count, 0.0);
+    for (unsigned int j = 0; j < leaf_count; ++j) {
+        if (j == a || map.branch(a, j) != aToInteriorBranch) dm.add_row(ta, j);
+        else if (j == b || map.branch(b, j) != bToInteriorBranch) dm.add_row(tb, j);
+    }
+
+    // same updates as swap_nodes, on copies of the path nodes
+    collect_path(interiorA, b, a, b, ta, tb);
+    double totalA = 0, totalB = 0;
+    for (auto& step : path) { totalA += step.hang_a; totalB += step.hang_b; }
+
+    double delta = 0.0, beforeA = 0, beforeB = 0;
+    for (auto& step : path) {
+        int aBranch = step.a_branch;
+        int bBranch = step.b_branch;
+        int cBranch = 3 - aBranch - bBranch;
+        double afterA = totalA - beforeA - step.hang_a;
+        double afterB = totalB - beforeB - step.hang_b;
+
+        const FullNode& fn = map[step.node];
+        int lc[3] = { fn.leaf_count[0], fn.leaf_count[1], fn.leaf_count[2] };
+        double dist[3] = { fn.dist[0], fn.dist[1], fn.dist[2] };
+        lc[aBranch] += countB - countA;
+        lc[bBranch] += countA - countB;
+        dist[cBranch] += beforeA + afterB - beforeB - afterA;
+        dist[aBranch] += step.hang_a - step.hang_b;
+        dist[bBranch] += step.hang_b - step.hang_a;
+        delta += node_score(lc, dist) - node_score(fn.leaf_count, fn.dist);
+
+        beforeA += step.hang_a;
+        beforeB += step.hang_b;
+    }
+    return delta;
+}
+
+template<class M> double QSearchFullTreeT<M>::evaluate_transfer(const unsigned int& p1, const unsigned int& p2)
 {
+    QSEARCH_SAMPLE_PHASE(PHASE_EVALUATE);
+    unsigned int interior = move_to(p1, p2);
+    unsigned int first = next_node(interior, p2);
+    if (first == p2) return 0.0;    // p1 already hangs next to p2
+
+    unsigned int sibling = find_sibling(p1, p2);
+    int toP1 = map.branch(interior, p1);
+    int toS = map.branch(interior, sibling);
+    int countP1 = map[interior].leaf_count[toP1];
+    int p2ToRest = map.branch(p2, first);
+    int countP2 = leaf_count - map[p2].leaf_count[p2ToRest];
+
+    // side: 1 below p1 (P1), 2 below p2 (P2), 3 below the sibling (S), 0 elsewhere;
+    // tp[j], tq[j] are the distances from leaf j to all of P1 and to all of P2
+    double* tp = leaf_sum_a.data();
+    double* tq = leaf_sum_b.data();
+    unsigned char* side = leaf_side.data();
+    std::fill(tp, tp + leaf_count, 0.0);
+    std::fill(tq, tq + leaf_count, 0.0);
+    unsigned int j;
+    for (j = 0; j < leaf_count; ++j) {
+        int br = map.branch(interior, j);
+        if (br == toP1) {
+            side[j] = 1;
+            dm.add_row(tp, j);
+        } else if (br == toS) side[j] = 3;
+        else if (j == p2 || map.branch(p2, j) != p2ToRest) {
+            side[j] = 2;
+            dm.add_row(tq, j);
+        } else side[j] = 0;
+    }
+    double dP1S = 0, dP1P2 = 0, dP1R = 0, dP2R = 0;   // R: all but P1 and P2
+    for (j = 0; j < leaf_count; ++j) {
+        if (side[j] == 1) continue;
+        if (side[j] == 2) { dP1P2 += tp[j]; continue; }
+        if (side[j] == 3) dP1S += tp[j];
+        dP1R += tp[j];
+        dP2R += tq[j];
+    }
+
+    // Every node between the interior node and p2 sees P1 move from its interior side (a),
+    // which holds P1, S and C_<m, to its p2 side (b), which holds P2 and C_>m:
+    //   dist[c] += d(P1, S + C_<m) - d(P1, P2 + C_>m),  dist[a] += d(P1,C_m),  dist[b] -= d(P1,C_m)
+    collect_path(first, p2, interior, p2, tp, nullptr);
+    double total = 0;
+    for (auto& step : path) total += step.hang_a;
+
+    double delta = 0.0, before = 0;
+    for (auto& step : path) {
+        int aBranch = step.a_branch;
+        int bBranch = step.b_branch;
+        int cBranch = 3 - aBranch - bBranch;
+        double after = total - before - step.hang_a;
+
+        const FullNode& fn = map[step.node];
+        int lc[3] = { fn.leaf_count[0], fn.leaf_count[1], fn.leaf_count[2] };
+        double dist[3] = { fn.dist[0], fn.dist[1], fn.dist[2] };
+        lc[aBranch] -= countP1;
+        lc[bBranch] += countP1;
+        dist[cBranch] += (dP1S + before) - (dP1P2 + after);
+        dist[aBranch] += step.hang_a;
+        dist[bBranch] -= step.hang_a;
+        delta += node_score(lc, dist) - node_score(fn.leaf_count, fn.dist);
+
+        before += step.hang_a;
+    }
+
+    // the interior node ends up joining P1, P2 and the rest R
+    const FullNode& in = map[interior];
+    int lc[3] = { countP1, countP2, (int)leaf_count - countP1 - countP2 };
+    double dist[3] = { dP2R, dP1R, dP1P2 };
+    delta += node_score(lc, dist) - node_score(in.leaf_count, in.dist);
+    return delta;
+}
+
+template<class M> void QSearchFullTreeT<M>::logged_swap(const unsigned int& a, const unsigned int& b)
+{
+    swap_nodes(a, b);
+    if (!move_log.empty() && ( move_log.back() == std::make_pair(a, b) || move_log.back() == std::make_pair(b, a) ))
+        move_log.pop_back();    // undid the last move
+    else
+        move_log.emplace_back(a, b);
+}
+
+template<class M> void QSearchFullTreeT<M>::rollback()
+{
+    while (!move_log.empty()) {
+        swap_nodes(move_log.back().first, move_log.back().second);
+        move_log.pop_back();
+    }
+}
+
+template<class M> double QSearchFullTreeT<M>::score() const
+{
+    double amin = dm.quartet_bounds->first, amax = dm.quartet_bounds->second;
+    return (amax - raw_score) / (amax - amin);
+}
+
+// One Metropolis move at inverse temperature beta (per unit of raw score). Moves are scored
+// first and only applied when accepted, or when they reach best_score (then they are applied,
+// on_best() sees the tree, and they are undone if rejected). Returns whether it was accepted.
+template<class M> template<class F> bool QSearchFullTreeT<M>::metropolis_step(double beta, QSearchRandom& r, double best_score, F on_best)
+{
+    unsigned int p1, p2;
+    random_pair(p1, p2, r);
+
+    double cur = raw_score;
+
+    if ( r.below(3) < 2) { 
+        
+        double now = cur + evaluate_swap(p1, p2);
+        bool best = now <= best_score || fabs(now - best_score) < 1e-6;
+        // calculate acceptance
+        double p = exp(beta * (cur-now) );
+        bool accept = r.uniform() < p;
+        QSEARCH_COUNT_MOVE(MOVE_SWAP, p, accept);
+
+        if (best) {
+            logged_swap(p1, p2);
+            on_best();
+            if (!accept) logged_swap(p1, p2);
+        } else if (accept) {
+            logged_swap(p1, p2);
+        }
+        return accept;
+
+    } else { // transfer tree
+        
+        double now = cur + evaluate_transfer(p1, p2);
+        bool best = now <= best_score || fabs(now - best_score) < 1e-6;
+        // calculate acceptance
+        double p = exp(beta * (cur-now) );
+        bool accept = r.uniform() < p;
+        QSEARCH_COUNT_MOVE(MOVE_TRANSFER, p, accept);
+        if (!best && !accept) return false;
+
+        int interior = move_to(p1, p2);
+        assert(interior != p2);
+         
+        int sibling = find_sibling(p1, p2);
+       
+        // move entire subtree containing p1 and sibling in the place of p2, then swap the
+        // sibling back in its original place (making 'node' a sibling of 'p2')
+        logged_swap(interior, p2);
+        logged_swap(sibling, p2);
+       
+        // postcondition: 
+        assert( find_sibling(p1, sibling) == p2);
+
+        if (best) {
+            on_best();
+            if (!accept) {
+                logged_swap(sibling, p2);
+                logged_swap(interior, p2);
+            }
+        }
+        return accept;
+    }
+}
+
+template<class M> double QSearchFullTreeT<M>::anneal(unsigned int steps, QSearchRandom& r)
+{
+    reserve_scratch();
+    pair_next = PAIR_BATCH;     // pairs left in the batch came from another generator
+    checkpoint();
+    double best_score = raw_score;
+    const double beta = 1.0; // set to 0.0 to mimick random behaviour. This behaviour is a metropolis markov chain
+     
+    for (unsigned int j = 0; j < steps; ++j)
+        metropolis_step(beta, r, best_score, [&] { checkpoint(); best_score = raw_score; });
+    rollback();     // back to the best shape
+    return raw_score;
+}
+
+template<class M> unsigned int QSearchFullTreeT<M>::metropolis(unsigned int steps, double beta, QSearchRandom& r, FullTreeSnapshot& best)
+{
+    unsigned int accepted = 0;
+    for (unsigned int j = 0; j < steps; ++j) {
+        accepted += metropolis_step(beta, r, best.raw_score, [&] { if (raw_score < best.raw_score) snapshot(best); });
+        checkpoint();   // nothing to roll back to, keep the log short
+    }
+    return accepted;
+}
+
+template<class M> std::unique_ptr< QSearchFullTreeT<M> > QSearchFullTreeT<M>::find_better_tree(int howManyTries, QSearchRandom& rng, QSearchThreadPool* pool) const
+{
+    QSEARCH_TIME_PHASE(PHASE_FIND_BETTER_TREE);
+    // Every try anneals its own copy of this tree (no rebuild from a QSearchTree) with its own
+    // generator. Copies that beat the best raw score so far are parked in their slot, the
+    // lowest score (lowest try on ties) wins once all tries are done.
+    std::atomic< double > best_raw(raw_score);
+    std::vector< std::unique_ptr< QSearchFullTreeT<M> > > slots(howManyTries);
+    std::vector< QSearchRandom > try_rng;
+    for (int i = 0; i < howManyTries; i += 1) try_rng.push_back( rng.split() );
+
+    auto run_try = [&](unsigned int i) {
+        std::unique_ptr< QSearchFullTreeT<M> > work( new QSearchFullTreeT<M>(*this) );
+        double cand = work->anneal(node_count, try_rng[i]);
+
+        double seen = best_raw.load();
+        while (cand < seen && !best_raw.compare_exchange_weak(seen, cand))
+            ;
+        if (cand < raw_score && cand <= seen) slots[i] = std::move(work);
+    };
+
+    if (pool) pool->parallel_for(howManyTries, run_try);
+    else for (int i = 0; i < howManyTries; i += 1) run_try(i);
+
+    std::unique_ptr< QSearchFullTreeT<M> > result;
+    for (auto& slot : slots) {
+        if (slot && (!result || slot->raw_score < result->raw_score))
+            std::swap(result, slot);
+    }
+    if (result) {
+        result->refresh();  // the incremental sums have drifted over the moves
+        if (!(result->raw_score < raw_score)) result.reset();
+    }
+    return result;
+}
+
+template<class M> void QSearchFullTreeT<M>::snapshot(FullTreeSnapshot& snap) const
+{
+    snap.connections.resize(3 * node_count);
+    for (unsigned int i = 0; i < node_count; ++i)
+        for (int j = 0; j < 3; ++j) snap.connections[3 * i + j] = map[i].connections[j];
+    snap.raw_score = raw_score;
+}
+
+template<class M> std::unique_ptr< QSearchTreeT<M> > QSearchFullTreeT<M>::to_searchtree() 
+{
+    FullTreeSnapshot snap;
+    snapshot(snap);
+    return to_searchtree(snap);
+}
+
+template<class M> std::unique_ptr< QSearchTreeT<M> > QSearchFullTreeT<M>::to_searchtree(const FullTreeSnapshot& snap) 
+{
+    QSEARCH_TIME_PHASE(PHASE_TO_SEARCHTREE);
     int leaf_count = (node_count + 2)/2;
     int i,j;
-    std::unique_ptr< QSearchTree > clt( new QSearchTree(dm));
+    std::unique_ptr< QSearchTreeT<M> > clt( new QSearchTreeT<M>(dm));
 
     // write out resulting tree in clt
     for (i = 0; i < leaf_count; ++i) {
         clt->leaf_placement[i] = i;
     }
     
+    for (i = 0; i < node_count; ++i) clt->n[i].clear();
     for (i = 0; i < node_count; ++i) {
-        QSearchNeighborList& lst = clt->n[i];
-        lst.clear();                           
-        //NodeList& n = lst.n;
         for (j = 0; j < 3; ++j) {
-            int con = map[i].connections[j];
-            if (con <= i) continue; // no need to write
-            lst.add_neighbor((unsigned int)con);
+            int con = snap.connections[3 * i + j];
+            if (con <= i) continue; // connected from the other side
+            clt->connect(i, con);
         }
     }
     
-    clt->score = (clt->dist_max - raw_score) / (clt->dist_max - clt->dist_min); 
+    // arrives scored, so score_tree() has nothing left to do
+    if (!clt->dist_calculated) clt->calc_min_max();
+    clt->score = (clt->dist_max - snap.raw_score) / (clt->dist_max - clt->dist_min); 
 
     clt->must_recalculate_paths = true;
     clt->f_score_good = true;
@@ -346,32 +590,32 @@ std::unique_ptr< QSearchTree > QSearchFullTree::to_searchtree()
     return clt;
 }
 
-unsigned int QSearchFullTree::move_to(unsigned int from, unsigned int to) {
-    return map[from].connections[ map[from].node_branch[to] ];
+template<class M> unsigned int QSearchFullTreeT<M>::move_to(unsigned int from, unsigned int to) {
+    return map[from].connections[ map.branch(from, to) ];
 }
 
-unsigned int QSearchFullTree::find_sibling(unsigned int node, unsigned int ancestor) 
+template<class M> unsigned int QSearchFullTreeT<M>::find_sibling(unsigned int node, unsigned int ancestor) 
 {
     assert(node != ancestor);
-    unsigned int parent = QSearchFullTree::move_to(node, ancestor);
+    unsigned int parent = move_to(node, ancestor);
     assert(parent != ancestor);
 
-    int branch2node = map[parent].node_branch[node];
-    int branch2ancestor = map[parent].node_branch[ancestor];
+    int branch2node = map.branch(parent, node);
+    int branch2ancestor = map.branch(parent, ancestor);
     int branch2sibling = 3 - branch2node - branch2ancestor;
 
     return map[parent].connections[ branch2sibling ];
 }
 
-double  QSearchFullTree::sum_distance(int a, int b) 
+template<class M> double  QSearchFullTreeT<M>::sum_distance(int a, int b) 
 {
     double sum = 0.0;
 
-    int node = map[a].connections[ map[a].node_branch[b] ];
+    int node = map[a].connections[ map.branch(a, b) ];
     int n = 0;
     while (node != b) {
-        int toa = map[node].node_branch[a];
-        int tob = map[node].node_branch[b];
+        int toa = map.branch(node, a);
+        int tob = map.branch(node, b);
         
         sum += npairs( map[node].leaf_count[ toa ] ) * map[node].dist[toa];
         sum += npairs( map[node].leaf_count[ tob ] ) * map[node].dist[tob];
@@ -382,18 +626,23 @@ double  QSearchFullTree::sum_distance(int a, int b)
     return sum / n;
 }
 
-double  QSearchFullTree::sum_distance_org(const unsigned int& a, const unsigned int& b) 
+template<class M> double  QSearchFullTreeT<M>::sum_distance_org(const unsigned int& a, const unsigned int& b) 
 {
-    int branch2b = map[a].node_branch[b];
-    int branch2a = map[b].node_branch[a];
+    int branch2b = map.branch(a, b);
+    int branch2a = map.branch(b, a);
 
     return npairs( map[a].leaf_count[branch2b] ) * map[a].dist[branch2b] + npairs( map[b].leaf_count[branch2a] ) * map[b].dist[branch2a];
 }
 
-void QSearchFullTree::get_children(const unsigned int&  node, const unsigned int& ancestor, unsigned int& child1, unsigned int& child2) 
+template<class M> void QSearchFullTreeT<M>::get_children(const unsigned int&  node, const unsigned int& ancestor, unsigned int& child1, unsigned int& child2) 
 {
-    int branch = map[node].node_branch[ancestor];
+    int branch = map.branch(node, ancestor);
     
     child1 = map[node].connections[ (3 + branch-1) % 3];
     child2 = map[node].connections[ (branch + 1) % 3];
 }
+
+template struct QSearchFullTreeT< QMatrix<double> >;
+template struct QSearchFullTreeT< QMatrix<float> >;
+template struct QSearchFullTreeT< QSymmetricMatrix<double> >;
+template struct QSearchFullTreeT< QSymmetricMatrix<float> >;
@@ -2,6 +2,14 @@
 #define __QSEARCH_FULLTREE_HPP
 
 #include "QSearchTree.hpp"
+#include "RandTools.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <memory>
+
+class QSearchThreadPool;
 
 // All data is statically allocated, so there's no need to resize things
 
@@ -12,38 +20,125 @@ struct FullNode {
     int         leaf_count[3];
     double      dist[3];
 
-    std::vector<unsigned char> node_branch; // pointing in the direction where to find a node
-
-    FullNode( const unsigned int& size );
+    FullNode();
 
     int find_branch(int to);
 };
 
+// Per node records plus the branch table: for every pair (node, to) the branch of node
+// pointing in the direction where to find 'to'. Branch codes take 2 bits and all rows
+// share one allocation, 32 codes per 64 bit word, so a tree is two allocations in total.
 struct FullNodeList {
+    static constexpr unsigned int BRANCH_UNSET = 3;
+
     std::vector< FullNode > nodes;
+    unsigned int row_words;             // 64 bit words per branch table row
+    std::vector< uint64_t > branches;
+
+    FullNodeList( const unsigned int& size ) 
+        : nodes( size ), row_words( (size + 31) / 32 ), branches( (size_t)size * ((size + 31) / 32), ~0ull ) {}
+
+    const FullNode& operator [](const unsigned int& i) const { return nodes[i]; }
+    FullNode&       operator [](const unsigned int& i)       { return nodes[i]; }
+
+    unsigned int branch(const unsigned int& node, const unsigned int& to) const {
+        return ( branches[ (size_t)node * row_words + (to >> 5) ] >> ( (to & 31) * 2 ) ) & 3;
+    }
+    void set_branch(const unsigned int& node, const unsigned int& to, const unsigned int& code) {
+        uint64_t& w = branches[ (size_t)node * row_words + (to >> 5) ];
+        const unsigned int shift = (to & 31) * 2;
+        w = ( w & ~(3ull << shift) ) | ( (uint64_t)code << shift );
+    }
+    void fill_branches(const unsigned int& node, const unsigned int& code) {
+        uint64_t pattern = 0;
+        for (int i = 0; i < 32; i++) pattern |= (uint64_t)code << (2 * i);
+        std::fill( branches.begin() + (size_t)node * row_words, branches.begin() + (size_t)(node + 1) * row_words, pattern );
+    }
+};
 
-    FullNodeList( const unsigned int& size ) : nodes( size, FullNode( size ) ) {}
+// Shape of a QSearchFullTree at one moment: the connections of every node and the raw score.
+// Taking one copies 3 ints per node; it becomes a QSearchTree only when asked to.
+struct FullTreeSnapshot {
+    std::vector< int > connections;     // 3 per node
+    double raw_score;
 
-    FullNode  operator [](const unsigned int& i) const { return nodes[i]; }
-    FullNode& operator [](const unsigned int& i)       { return nodes[i]; }
+    FullTreeSnapshot() : raw_score(0.0) {}
+    bool empty() const { return connections.empty(); }
+};
+
+// A node on the path between two moved subtrees: its branches towards either end and the
+// distance sums from the leaves hanging off its third branch to the moved leaves
+struct FullPathStep {
+    unsigned int node;
+    int a_branch, b_branch;
+    double hang_a, hang_b;
 };
 
 // roll into QSearchTree?
-struct QSearchFullTree {
+// Distances are read from M as D; dist, raw_score and the scratch sums stay double.
+template<class M> struct QSearchFullTreeT {
+    typedef typename M::value_type D;
     unsigned int node_count, leaf_count;
     double       raw_score;
     FullNodeList map;
-    QMatrix<double>& dm;
+    M& dm;
+
+    // candidate pairs drawn in bulk by random_pair()
+    static constexpr unsigned int PAIR_BATCH = 64;
+    uint32_t pair_a[PAIR_BATCH], pair_b[PAIR_BATCH];
+    unsigned int pair_next;
+
+    // scratch space for swap_nodes and the move evaluations, sized once so moves never allocate
+    NodeList scratch_a, scratch_b;
+    std::vector< double > leaf_sum_a, leaf_sum_b;   // per leaf: distance sum to the moved leaves
+    std::vector< unsigned char > leaf_side;         // per leaf: which moved subtree it is in, if any
+    std::vector< FullPathStep > path;
+    NodeList walk_stack;
 
-    QSearchFullTree(const QSearchTree& clt); // was qsearch_make_fulltree()
+    // swaps applied since the last checkpoint; swap_nodes is its own inverse, so replaying
+    // them backwards rolls the tree back
+    std::vector< std::pair< unsigned int, unsigned int > > move_log;
 
-    void random_pair(unsigned int& a, unsigned int& b);    // from qsearch-tree.c
+    QSearchFullTreeT(const QSearchTreeT<M>& clt); // was qsearch_make_fulltree(); computes missing quartet bounds
+    void reserve_scratch();     // copies do not keep the capacity
+
+    // tries as in QSearchTree::find_better_tree, each on its own copy of this tree. Returns the
+    // best end state with exact distance sums, or nothing if no try beat this tree
+    std::unique_ptr< QSearchFullTreeT > find_better_tree(int howManyTries, QSearchRandom& rng, QSearchThreadPool* pool = nullptr) const;
+    // steps Metropolis moves; the tree is left in the best shape met on the way
+    double anneal(unsigned int steps, QSearchRandom& rng);
+    // steps Metropolis moves at inverse temperature beta, per unit of raw score. The tree stays
+    // where the walk ends; shapes scoring below best.raw_score are saved in best. Returns the
+    // number of moves accepted
+    unsigned int metropolis(unsigned int steps, double beta, QSearchRandom& rng, FullTreeSnapshot& best);
+    template<class F> bool metropolis_step(double beta, QSearchRandom& rng, double best_score, F on_best);
+    void logged_swap(const unsigned int& a, const unsigned int& b);
+    void checkpoint() { move_log.clear(); }
+    void rollback();
+    // recompute the distance sums and raw score from the matrix, dropping rounding drift
+    void refresh();
+    // normalized like QSearchTree::score_tree, by the quartet bounds the constructor made sure of
+    double score() const;
+
+    // two distinct, non-adjacent nodes. Refills the batch from rng when it runs out
+    void random_pair(unsigned int& a, unsigned int& b, QSearchRandom& rng);    // from qsearch-tree.c
     void set_score();
-    std::unique_ptr< QSearchTree > to_searchtree(); 
+    std::unique_ptr< QSearchTreeT<M> > to_searchtree(); 
+    void snapshot(FullTreeSnapshot& snap) const;
+    std::unique_ptr< QSearchTreeT<M> > to_searchtree(const FullTreeSnapshot& snap);
     unsigned int next_node(const unsigned int& from, const unsigned int& to);
     // bool can_swap(const unsigned int& A, const unsigned int& B); // deprecated - not called
     bool can_swap(const unsigned int& a, const unsigned int& b);
     void swap_nodes(const unsigned int& a, const unsigned int& b);
+    // fill path with the nodes from 'from' up to (not including) 'to'; a and b give the branch
+    // directions, ta and tb (may be null) the per leaf sums added up over every hanging subtree
+    void collect_path(unsigned int from, const unsigned int& to, const unsigned int& a, const unsigned int& b,
+                      const double* ta, const double* tb);
+    // raw score change swap_nodes(a, b) would make, without touching the tree
+    double evaluate_swap(const unsigned int& a, const unsigned int& b);
+    // raw score change of moving p1 (with its interior node) next to p2, as the two swaps
+    // of a subtree transfer do, without touching the tree
+    double evaluate_transfer(const unsigned int& p1, const unsigned int& p2);
     unsigned int move_to(unsigned int from, unsigned int to);
     unsigned int find_sibling(unsigned int node, unsigned int ancestor);
     double  sum_distance(int a, int b);
@@ -52,4 +147,9 @@ struct QSearchFullTree {
     void    get_children(const unsigned int&  node, const unsigned int& ancestor, unsigned int& child1, unsigned int& child2);  
 };
 
+typedef QSearchFullTreeT< QMatrix<double> > QSearchFullTree;
+typedef QSearchFullTreeT< QMatrix<float> >  QSearchFullTreeFloat;
+typedef QSearchFullTreeT< QSymmetricMatrix<double> > QSearchFullTreePacked;
+typedef QSearchFullTreeT< QSymmetricMatrix<float> >  QSearchFullTreePackedFloat;
+
 #endif // __QSEARCH_FULLTREE_HPP
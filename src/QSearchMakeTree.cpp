@@ -1,16 +1,20 @@
 #include "QSearchMakeTree.hpp"
+#include "QMatrixFile.hpp"
+#include "QSearchTelemetry.hpp"
 #include <cstring>
+#include <cstdlib>
 
 static QSearchMakeTree *qsmaketree;
 static const std::string qsearch_package_version = "0.7.1"; 
 
-void MakeTreeObserver::operator()(QSearchTree& old, QSearchTree& improved)
+template<class M> void MakeTreeObserver<M>::operator()(QSearchTreeT<M>& old, QSearchTreeT<M>& improved)
 {
     std::cout << improved.score_tree() << "   (lmsd=" << mtr.tm.get_lmsd() << ")\n";
     make_tree.write_tree_file(improved);
+    if (make_tree.write_stats) make_tree.write_stats_file();
 }
 
-void MakeTreeObserver::operator()(QSearchTree& final)
+template<class M> void MakeTreeObserver<M>::operator()(QSearchTreeT<M>& final)
 {
     std::cout << final.score_tree() << "\n";
     make_tree.write_tree_file(final);
@@ -71,32 +75,89 @@ gibbon 0.852812 0.923614 0.943204 0.941398 0.926042 0.949129 0.841267 0.918229 0
 graySeal 0.935368 0.890485 0.935632 0.934247 0.879032 0.939430 0.929297 0.893477 0.883482 0.919522 0.910034 0.925756 0.890884 0.897267 0.924796 0.919609 0.914076 0.897068 0.922209 0.915619 0.910448 0.383852 0.930610 0.903451 0.934224 0.917614 0.921355 0.899461 0.926591 0.889288 0.928102 0.893078 0.929797 0.000000 
 )";
 
+template<class D> bool QSearchMakeTree::parse_matrix(QMatrix<D>& dm, const std::string& matstr)
+{
+    QSearchThreadPool pool(thread_count);
+    unsigned int asymmetric = 0;
+    if (!dm.from_string(matstr, &pool, &asymmetric)) return false;
+    if (asymmetric) std::cout << asymmetric << " entries differ across the diagonal, using averages\n";
+    return true;
+}
+
+template<class D> bool QSearchMakeTree::load_matrix(QMatrix<D>& dm)
+{
+    if (QMatrixFile::is_matrix_file(matrix_filename)) {
+        QMatrixFile mf;
+        if (!mf.open(matrix_filename)) return false;
+        mf.to_matrix(dm);
+        return true;
+    }
+    std::string matstr;
+    if (!read_whole_file(matstr, matrix_filename)) return false;
+    return parse_matrix(dm, matstr);
+}
+
 void QSearchMakeTree::make_tree(const std::string& matstr)
 {
     QMatrix<double> dm;     // owner of matrix?
 
-    dm.from_string(matstr);
+    if (!parse_matrix(dm, matstr)) return;
+    make_tree(dm);
+}
+
+template<class D> void QSearchMakeTree::make_tree(QMatrix<D>& dm)
+{
     dm.make_symmetric();
-    std::cout << "Starting search on matrix size " << dm.dim << "\n";
-    QSearchManager cltm(dm);
-    QSearchTree tree(dm);
-    MakeTreeResult mtr(cltm,tree);
-    MakeTreeObserver mto( *this, mtr );
+    search(dm);
+}
+
+template<class D> bool QSearchMakeTree::make_tree_packed()
+{
+    QMatrixFile mf;     // mapped for as long as the search runs
+    QSymmetricMatrix<D> sm;
+    if (QMatrixFile::is_matrix_file(matrix_filename)) {
+        if (!mf.open(matrix_filename)) return false;
+        sm.view(mf);
+    }
+    else {
+        QMatrix<D> dm;
+        if (!load_matrix(dm)) return false;
+        sm.assign(dm);  // averages across the diagonal itself
+    }   // the full matrix is gone before the search starts
+    search(sm);
+    return true;
+}
+
+template<class M> void QSearchMakeTree::search(M& dm)
+{
+    std::cout << "Starting search on matrix size " << dm.dim << " (seed " << seed << ")\n";
+    telemetry_reset();
+    QSearchManagerT<M> cltm(dm, seed, thread_count);
+    QSearchTreeT<M> tree(dm);
+    MakeTreeResult<M> mtr(cltm,tree);
+    MakeTreeObserver<M> mto( *this, mtr );
     cltm.add_observer(mto, mto, mto);
-    cltm.find_best_tree();
+    if (replicas > 0) {
+        QSearchTemperingOptions options;
+        options.replicas = replicas;
+        cltm.find_best_tree_tempering(options);
+    }
+    else cltm.find_best_tree();
+    std::cout << cltm.moves << " moves tried\n";
+    if (write_stats) write_stats_file();
 }
 
 void QSearchMakeTree::make_tree(const std::string& matstr, start_fn tree_search_started, improve_fn tried_to_improve, done_fn tree_search_done)
 {
     QMatrix<double> dm;     // owner of matrix?
 
-    dm.from_string(matstr);
+    if (!parse_matrix(dm, matstr)) return;
     dm.make_symmetric();
-    std::cout << "Starting search on matrix size " << dm.dim << "\n";
-    QSearchManager cltm(dm);
+    std::cout << "Starting search on matrix size " << dm.dim << " (seed " << seed << ")\n";
+    QSearchManager cltm(dm, seed, thread_count);
     QSearchTree tree(dm);
-    MakeTreeResult mtr(cltm,tree);
-    MakeTreeObserver mto( *this, mtr );
+    MakeTreeResult< QMatrix<double> > mtr(cltm,tree);
+    MakeTreeObserver< QMatrix<double> > mto( *this, mtr );
     cltm.add_observer(mto, mto, mto);
     cltm.add_observer(tree_search_started, tried_to_improve, tree_search_done);
     cltm.find_best_tree();
@@ -149,6 +210,45 @@ void QSearchMakeTree::process_options_unix(char **argv)
       output_nexus = true;
       continue;
     }
+    if (strcmp(*cur, "-t") == 0) {
+      if (cur[1] == NULL) {
+        std::cout << "-t requires an argument";
+        print_help_and_exit();
+      }
+      thread_count = atoi(cur[1]);
+      cur += 1;
+      continue;
+    }
+    if (strcmp(*cur, "-T") == 0) {
+      if (cur[1] == NULL) {
+        std::cout << "-T requires an argument";
+        print_help_and_exit();
+      }
+      replicas = atoi(cur[1]);
+      cur += 1;
+      continue;
+    }
+    if (strcmp(*cur, "-s") == 0) {
+      if (cur[1] == NULL) {
+        std::cout << "-s requires an argument";
+        print_help_and_exit();
+      }
+      seed = strtoull(cur[1], NULL, 10);
+      cur += 1;
+      continue;
+    }
+    if (strcmp(*cur, "-f") == 0) {
+      single_precision = true;
+      continue;
+    }
+    if (strcmp(*cur, "-p") == 0) {
+      packed = true;
+      continue;
+    }
+    if (strcmp(*cur, "--stats") == 0) {
+      write_stats = true;
+      continue;
+    }
     if (matrix_filename.length() == 0) {
       matrix_filename = *cur;
       continue;
@@ -156,12 +256,24 @@ void QSearchMakeTree::process_options_unix(char **argv)
     std::cout << "Unrecognized argument: " << *cur;
   }
   if (matrix_filename.empty()) print_help_and_exit();
-  read_whole_file(matstr, matrix_filename);
-  make_tree(matstr);
+  if (packed) {
+    bool loaded = single_precision ? make_tree_packed<float>() : make_tree_packed<double>();
+    if (!loaded) exit(1);
+  }
+  else if (single_precision) {
+    QMatrix<float> dm;
+    if (!load_matrix(dm)) exit(1);
+    make_tree(dm);
+  }
+  else {
+    QMatrix<double> dm;
+    if (!load_matrix(dm)) exit(1);
+    make_tree(dm);
+  }
 }
 
 // Full implementation deferred
-void QSearchMakeTree::write_tree_file(QSearchTree& tree) {
+template<class M> void QSearchMakeTree::write_tree_file(QSearchTreeT<M>& tree) {
   if (output_nexus) {
     /* deferred
     char *fname = g_strdup_printf("%s.nex", top().get_filestem());
@@ -181,11 +293,29 @@ void QSearchMakeTree::write_tree_file(QSearchTree& tree) {
   }
 }
 
+// rewritten on every better tree, so a long search can be watched while it runs
+void QSearchMakeTree::write_stats_file()
+{
+  std::string json = telemetry_snapshot().to_json();
+  if (filestem.compare("-") == 0) std::cout << json;
+  else write_whole_file( json, filestem + ".stats.json" );
+}
+
 void QSearchMakeTree::print_help_and_exit() // Say "friend" and enter
 {
   std::cout << "Usage:\n\n";
-  std::cout << "maketree [-v] [-n] <distmatrix>\n";
+  std::cout << "maketree [-v] [-n] [-f] [-p] [--stats] [-t threads] [-T replicas] [-s seed] <distmatrix>\n";
+  std::cout << "          distmatrix is a text matrix or a binary one from convertmatrix\n";
   std::cout << "          -v  print version\n";
   std::cout << "          -n  nexus instead of dot output format\n";
+  std::cout << "          -t  number of search threads (default: one per core)\n";
+  std::cout << "          -T  parallel tempering with this many replicas (at least 2)\n";
+  std::cout << "              instead of independent buckets\n";
+  std::cout << "          -s  random seed, to repeat a search exactly with any number of threads\n";
+  std::cout << "          -f  keep distances in single precision, half the memory traffic\n";
+  std::cout << "          -p  keep only the upper triangle: half the memory, slower moves; binary\n";
+  std::cout << "              matrices are then searched in place without a copy\n";
+  std::cout << "          --stats  write move counts, phase times and the score over time to\n";
+  std::cout << "              <stem>.stats.json (needs a build with QSEARCH_TELEMETRY)\n";
   exit(0);
 }
@@ -2,14 +2,15 @@
 #define __QSEARCH_MAKE_TREE_H
 
 #include "QSearchManager.hpp"
+#include "RandTools.hpp"
 
 // Should this structure own the objects or hold references?
-struct MakeTreeResult {
-    QSearchManager& tm;
-    QMatrix<double>& mat; 
-    QSearchTree& tree;
+template<class M> struct MakeTreeResult {
+    QSearchManagerT<M>& tm;
+    M& mat; 
+    QSearchTreeT<M>& tree;
 
-    MakeTreeResult( QSearchManager& tm_init, QSearchTree& tree_init ) : tm( tm_init ), tree( tree_init ), mat( tree_init.dm ) {}
+    MakeTreeResult( QSearchManagerT<M>& tm_init, QSearchTreeT<M>& tree_init ) : tm( tm_init ), tree( tree_init ), mat( tree_init.dm ) {}
 };
 
 struct QSearchMakeTree
@@ -20,36 +21,54 @@ struct QSearchMakeTree
     bool dot_show_details;        // show various extra data in dot output
     std::string filestem;         // initial part of output filename without extension
     std::string dot_title;        // title for the output .dot tree file
+    unsigned int thread_count;    // search threads, 0 = one per hardware thread
+    uint64_t seed;                // seed for the search, random unless given with -s
+    bool single_precision;        // search on a float copy of the matrix (-f)
+    bool packed;                  // keep the upper triangle only, half the memory (-p)
+    unsigned int replicas;        // parallel tempering with this many replicas, 0 = bucket search (-T)
+    bool write_stats;             // search telemetry as JSON next to the tree file (--stats)
 
     QSearchMakeTree() : 
         output_nexus(false), 
         dot_show_ring(true), 
         dot_show_details(true), 
         filestem("treefile"), 
-        dot_title("tree")
+        dot_title("tree"), 
+        thread_count(0), 
+        seed(random_seed()), 
+        single_precision(false), 
+        packed(false), 
+        replicas(0), 
+        write_stats(false)
     {}
 
+    template<class D> bool parse_matrix(QMatrix<D>& dm, const std::string& matstr);
+    template<class D> bool load_matrix(QMatrix<D>& dm);   // from matrix_filename, text or binary
     void make_tree(const std::string& matstr);
+    template<class D> void make_tree(QMatrix<D>& dm);
+    template<class D> bool make_tree_packed();    // from matrix_filename; binary files are read in place
+    template<class M> void search(M& dm);         // dm is symmetric already
     void make_tree(const std::string& matstr, start_fn tree_search_started, improve_fn tried_to_improve, done_fn tree_search_done);
 
     void process_options(char **argv);
     void process_options_unix(char **argv);
     void process_options_web(char **argv);
-    void write_tree_file(QSearchTree& tree);
+    template<class M> void write_tree_file(QSearchTreeT<M>& tree);
+    void write_stats_file();
     void print_help_and_exit();
 };
 
 // Functor encapsulating callbacks 
-struct MakeTreeObserver {
-    QMatrix<double>& dm;
+template<class M> struct MakeTreeObserver {
+    M& dm;
     QSearchMakeTree& make_tree;
-    MakeTreeResult& mtr;
+    MakeTreeResult<M>& mtr;
 
-    void operator () () {}                                      // start_fn
-    void operator () (QSearchTree& old, QSearchTree& improved); // improve_fn
-    void operator () (QSearchTree& final);                      // done_fn
+    void operator () () {}                                              // start_fn
+    void operator () (QSearchTreeT<M>& old, QSearchTreeT<M>& improved); // improve_fn
+    void operator () (QSearchTreeT<M>& final);                          // done_fn
 
-    MakeTreeObserver(QSearchMakeTree& make_tree_init, MakeTreeResult& mtr_init) 
+    MakeTreeObserver(QSearchMakeTree& make_tree_init, MakeTreeResult<M>& mtr_init) 
         : dm(mtr_init.mat), make_tree(make_tree_init), mtr(mtr_init) {}
 };
 
@@ -1,6 +1,8 @@
 #include "QSearchManager.hpp"
+#include "QSearchTelemetry.hpp"
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 
 static int recommended_tree_duplicity(int how_many_leaves)
 {
@@ -12,12 +14,17 @@ static int recommended_tree_duplicity(int how_many_leaves)
   return i;
 }
 
-QSearchManager::QSearchManager(QMatrix<double>& dm_init) // was QSearchTreeMaster *new(QMatrix& dm);
-  : dm(dm_init), lmsd(-1.0), abort_search(false)  
+template<class M> QSearchManagerT<M>::QSearchManagerT(M& dm_init) // was QSearchTreeMaster *new(QMatrix& dm);
+  : QSearchManagerT<M>(dm_init, random_seed())
+{}
+
+template<class M> QSearchManagerT<M>::QSearchManagerT(M& dm_init, uint64_t seed, unsigned int thread_count)
+  : dm(dm_init), lmsd(-1.0), abort_search(false), pool(new QSearchThreadPool(thread_count)), rng(seed), notifier(nullptr), moves(0)
 {
+  QSearchRandomScope scope(rng);  // initial mutations draw from the seeded generator
   int fs = recommended_tree_duplicity(dm.dim);
   for (int i = 0; i < fs; i++) {
-    forest.push_back( tree_ptr( new QSearchTree( dm ) ) );
+    forest.push_back( std::unique_ptr< QSearchTreeT<M> >( new QSearchTreeT<M>( dm ) ) );
     /* if (i == 0) {
       std::ofstream f("treefile.dot");
       f << forest[i]->to_dot();
@@ -26,105 +33,211 @@ QSearchManager::QSearchManager(QMatrix<double>& dm_init) // was QSearchTreeMaste
     forest[i]->complex_mutation();
     forest[i]->complex_mutation();
   }
+  for (auto& t : forest) t->calc_min_max(pool.get());  // first one fills the matrix's cache
+  for (auto& t : forest) live.push_back( std::unique_ptr< QSearchFullTreeT<M> >( new QSearchFullTreeT<M>( *t ) ) );
+  scores.reset( new std::atomic< double >[ live.size() ] );
+  for (unsigned int i = 0; i < live.size(); i++) scores[i].store( live[i]->score() );
+}
+
+QSearchNotifier::QSearchNotifier(bool threaded) : stopping(false)
+{
+  if (threaded) thread = std::thread( [this] {
+    std::unique_lock< std::mutex > l(lock);
+    for (;;) {
+      wake.wait(l, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) return;  // stopping
+      std::function< void () > f = std::move(queue.front());
+      queue.pop_front();
+      l.unlock();
+      f();
+      l.lock();
+    }
+  } );
+}
+
+QSearchNotifier::~QSearchNotifier()
+{
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard< std::mutex > l(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  thread.join();
 }
 
-void QSearchManager::add_observer(  start_fn tree_search_started, improve_fn tried_to_improve, 
-                                    done_fn tree_search_done ) 
+void QSearchNotifier::post(std::function< void () > f)
 {
-  QSearchObserver cp(tree_search_started, tried_to_improve, tree_search_done);
+  if (!thread.joinable()) { f(); return; }
+  {
+    std::lock_guard< std::mutex > l(lock);
+    queue.push_back( std::move(f) );
+  }
+  wake.notify_one();
+}
+
+template<class M> void QSearchManagerT<M>::add_observer(  start_fn tree_search_started, improve_fn_t<M> tried_to_improve, 
+                                    done_fn_t<M> tree_search_done ) 
+{
+  QSearchObserverT<M> cp(tree_search_started, tried_to_improve, tree_search_done);
   obs.push_back(cp);
 }
 
-void QSearchManager::try_to_improve_bucket(unsigned int i)
+template<class M> void QSearchManagerT<M>::set_thread_count(unsigned int thread_count)
+{
+  pool.reset( new QSearchThreadPool(thread_count) );
+}
+
+template<class M> void QSearchManagerT<M>::try_to_improve_bucket(unsigned int i, QSearchRandom& bucket_rng)
 {
   const int NUMTRIESPERBIGTRY = 24; // can this constant live somewhere else?
-  int j;
 
-  auto& old = forest[i];
-  tree_ptr cand = old->find_better_tree(NUMTRIESPERBIGTRY) ; // find better tree
+  auto& old = live[i];
+  std::unique_ptr< QSearchFullTreeT<M> > cand = old->find_better_tree(NUMTRIESPERBIGTRY, bucket_rng, pool.get()) ; // find better tree
+  moves += (uint64_t)NUMTRIESPERBIGTRY * old->node_count;   // each try anneals node_count steps
   if(cand.get() != NULL) {
+    QSEARCH_COUNT_IMPROVEMENT(cand->score());
     if (!was_search_stopped() && i == 0 && obs.size() > 0) {
-      for(auto& ob : obs) { ob.tried_to_improve(*old, *cand); }
+      // the notifier gets trees of its own, the search goes on while observers look at them
+      bucket_tree(i);
+      std::shared_ptr< QSearchTreeT<M> > old_tree( std::move( forest[i] ) );
+      forest[i] = cand->to_searchtree();
+      std::shared_ptr< QSearchTreeT<M> > cand_tree( new QSearchTreeT<M>( *forest[i] ) );
+      auto notify = [this, old_tree, cand_tree] { for(auto& ob : obs) { ob.tried_to_improve(*old_tree, *cand_tree); } };
+      if (notifier) notifier->post(notify);
+      else notify();
+    } else {
+      forest[i].reset();
     }
     std::swap( old, cand ); // rather than setting one equal to the other, as they are unique
   }
+  scores[i].store( live[i]->score() );
+}
+
+// Trees are only built for observers and the final answer; the search itself works on live
+template<class M> QSearchTreeT<M>& QSearchManagerT<M>::bucket_tree(unsigned int i)
+{
+  if (!forest[i]) forest[i] = live[i]->to_searchtree();   // arrives scored
+  return *forest[i];
 }
 
-QSearchTree QSearchManager::find_best_tree()
+template<class M> QSearchTreeT<M> QSearchManagerT<M>::find_best_tree()
 {
-  int i, j;
-  double bestsco = -1.0;
-  double osco, nsco;
+  QSEARCH_TIME_PHASE(PHASE_FIND_BEST_TREE);
   double ERRTOL = 1.0e-6;  // ERRTOL undefined in C version repository. 
+  const unsigned int buckets = live.size();
 
   abort_search = false;
   for(auto ob: obs) ob.tree_search_started();
-  do {
-    for (i = 0; i < forest.size(); i += 1) {
-      assert( forest[i].get() != NULL);
-      osco = forest[i]->score_tree();
-      assert( osco <= 1.0 + ERRTOL);
-      //std::cout << "osco is " << osco << std::endl;
-      try_to_improve_bucket(i);
-      assert( forest[i].get() != NULL);
-      nsco = forest[i]->score_tree();
-      if (nsco < osco) {
-        fprintf(stderr, "Error, tree degraded: %f %f.\n", osco, nsco);
-        exit(1);
+
+  // Buckets improve in rounds: every bucket makes one attempt per round, on the pool, then the
+  // published scores are compared, so even a converged forest gets one round. Each bucket has
+  // its own generator and its attempts never look at the other buckets, so a seed repeats the
+  // same search for any thread count.
+  // Rounds replace free-running bucket tasks on purpose: with those, how many attempts each
+  // bucket made before the scores agreed was up to thread timing. The barrier costs little, as
+  // every attempt is the same number of annealing steps and spreads its tries over the pool too.
+  std::vector< QSearchRandom > bucket_rng;
+  for (unsigned int i = 0; i < buckets; i++) bucket_rng.push_back( rng.split() );
+  {
+    QSearchNotifier bucket0_notifier( pool->size() > 1 );
+    notifier = &bucket0_notifier;
+    do {
+      pool->parallel_for(buckets, [&](unsigned int i) {
+        if (abort_search) return;
+        double osco = scores[i].load();
+        assert( osco <= 1.0 + ERRTOL);
+        try_to_improve_bucket(i, bucket_rng[i]);
+        double nsco = scores[i].load();
+        if (nsco < osco) {
+          fprintf(stderr, "Error, tree degraded: %f %f.\n", osco, nsco);
+          exit(1);
+        }
+      });
+    } while (!is_done());
+    notifier = nullptr;
+  }   // waits for pending notifications
+
+  QSearchTreeT<M>& answer = bucket_tree(0);
+  if (!was_search_stopped() && obs.size() > 0) {
+    for (auto& ob : obs) { ob.tree_search_done(answer); }
+  }
+  return answer;
+}
+
+template<class M> QSearchTreeT<M> QSearchManagerT<M>::find_best_tree_tempering(const QSearchTemperingOptions& options)
+{
+  QSEARCH_TIME_PHASE(PHASE_FIND_BEST_TREE);
+  abort_search = false;
+  for(auto ob: obs) ob.tree_search_started();
+
+  QSearchTemperingT<M> pt(*live[0], options, rng.split());
+  {
+    QSearchNotifier tempering_notifier( pool->size() > 1 );
+    unsigned int stale = 0;
+    while (!abort_search && stale < pt.options.patience) {
+      uint64_t before = pt.moves;
+      bool improved = pt.round(pool.get());
+      moves += pt.moves - before;
+      // lmsd as for the buckets: how far the replicas are from the one at the cold end
+      double deviation = 0.0;
+      for (auto& r : pt.replicas) deviation = std::max( deviation, fabs(r->score() - pt.replicas[0]->score()) );
+      lmsd = deviation;
+      if (!improved) { stale++; continue; }
+      stale = 0;
+
+      // the new best becomes bucket 0, with exact sums
+      bucket_tree(0);
+      std::shared_ptr< QSearchTreeT<M> > old_tree( std::move( forest[0] ) );
+      std::unique_ptr< QSearchTreeT<M> > shape = live[0]->to_searchtree(pt.best);
+      live[0].reset( new QSearchFullTreeT<M>( *shape ) );
+      forest[0] = live[0]->to_searchtree();
+      scores[0].store( live[0]->score() );
+      QSEARCH_COUNT_IMPROVEMENT(live[0]->score());
+      if (obs.size() > 0) {
+        std::shared_ptr< QSearchTreeT<M> > cand_tree( new QSearchTreeT<M>( *forest[0] ) );
+        tempering_notifier.post( [this, old_tree, cand_tree] { for(auto& ob : obs) { ob.tried_to_improve(*old_tree, *cand_tree); } } );
       }
-      if (nsco > bestsco)
-        bestsco = nsco;
     }
-  } while (!is_done());
-  assert( forest[0].get() != NULL );
-  QSearchTree& answer = *forest[0];
-  double gsco;
-  gsco = answer.score_tree();
-  if (!was_search_stopped()) {
-  if (fabs(gsco - bestsco) > 1e-6) {
-//    fprintf(stderr, "WARNING: Best score was %f but gsco was %f\n", bestsco, gsco);
-    ;
-  }
-  }
+  }   // waits for pending notifications
+
+  QSearchTreeT<M>& answer = bucket_tree(0);
   if (!was_search_stopped() && obs.size() > 0) {
     for (auto& ob : obs) { ob.tree_search_done(answer); }
   }
   return answer;
 }
 
-bool QSearchManager::was_search_stopped()
+template<class M> bool QSearchManagerT<M>::was_search_stopped()
 {
   return abort_search;
 }
 
-void QSearchManager::stop_search()
+template<class M> void QSearchManagerT<M>::stop_search()
 {
   abort_search = true;
 }
 
-double QSearchManager::get_lmsd()
+template<class M> double QSearchManagerT<M>::get_lmsd()
 {
   return lmsd;
 }
 
-bool QSearchManager::is_done()
+// compares the scores the buckets published last, so it is safe to call while they search
+template<class M> bool QSearchManagerT<M>::is_done()
 {
   const double MAXSCOREDIFF = 8e-14;
   if (abort_search)
     return true;
-  lmsd = -1.0;
-  assert( forest[0].get() != NULL );
-  QSearchTree& orig = *forest[0];
-  double csco = orig.score_tree();
-  int i;
-  for(auto& tree : forest) {
-    assert( tree.get() != NULL);
-    double sco = tree->score_tree();
-    double deltasco = fabs(sco - csco);
-    if (lmsd == -1.0 || lmsd < deltasco)
-      lmsd = deltasco;
-    if (lmsd > MAXSCOREDIFF)
-      return false;
-  }
-  return true;
-}
\ No newline at end of file
+  double csco = scores[0].load();
+  double deviation = 0.0;
+  for (unsigned int i = 0; i < live.size(); i++)
+    deviation = std::max( deviation, fabs(scores[i].load() - csco) );
+  lmsd = deviation;
+  return deviation <= MAXSCOREDIFF;
+}
+
+template struct QSearchManagerT< QMatrix<double> >;
+template struct QSearchManagerT< QMatrix<float> >;
+template struct QSearchManagerT< QSymmetricMatrix<double> >;
+template struct QSearchManagerT< QSymmetricMatrix<float> >;
@@ -2,26 +2,38 @@
 #define __QSEARCH_MANAGER_H
 
 #include "QSearchTree.hpp"
+#include "QSearchFullTree.hpp"
+#include "QSearchThreadPool.hpp"
+#include "QSearchTempering.hpp"
+#include "RandTools.hpp"
 
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // callback function types
 typedef std::function< void () > start_fn;
-typedef std::function< void (QSearchTree&, QSearchTree&) > improve_fn;
-typedef std::function< void (QSearchTree&) > done_fn;
+template<class M> using improve_fn_t = std::function< void (QSearchTreeT<M>&, QSearchTreeT<M>&) >;
+template<class M> using done_fn_t = std::function< void (QSearchTreeT<M>&) >;
+typedef improve_fn_t< QMatrix<double> > improve_fn;
+typedef done_fn_t< QMatrix<double> > done_fn;
 
 // Callbacks called as tree improves over long runs. Can be simple alerts or complex animations.
 // Observer no longer contains void* user_data - functors can contain their own state as needed
-struct QSearchObserver {
+template<class M> struct QSearchObserverT {
     start_fn tree_search_started;
-    improve_fn tried_to_improve;
-    done_fn tree_search_done;
+    improve_fn_t<M> tried_to_improve;
+    done_fn_t<M> tree_search_done;
 
-    QSearchObserver(start_fn& search_init, improve_fn improve_init, done_fn done_init)
+    QSearchObserverT(start_fn& search_init, improve_fn_t<M> improve_init, done_fn_t<M> done_init)
         : tree_search_started(search_init), tried_to_improve(improve_init), tree_search_done(done_init)
         {}
 };
+typedef QSearchObserverT< QMatrix<double> > QSearchObserver;
 
 // "stub" functor which contains one overload for each of the fu
 struct tree_observer_adaptor {
@@ -36,22 +48,53 @@ struct tree_observer_adaptor {
 
 typedef std::unique_ptr< QSearchTree > tree_ptr;
 
+// Runs observer callbacks one after the other on a thread of its own, so buckets never wait
+// for them. Without a thread (single-threaded search) callbacks run inline. The destructor
+// waits for everything posted so far.
+struct QSearchNotifier {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque< std::function< void () > > queue;
+    bool stopping;
+
+    explicit QSearchNotifier(bool threaded);
+    ~QSearchNotifier();
+    void post(std::function< void () > f);
+};
+
 // Manages the search for a better tree and keeps user informed
-// Uses "Manager" design pattern
-struct QSearchManager
+// Uses "Manager" design pattern. M is the distance matrix type, see QSearchTreeT.
+template<class M> struct QSearchManagerT
 {
-    std::vector< tree_ptr > forest;   
-    QMatrix<double>&  dm; 
-    std::vector< QSearchObserver > obs;  // vector of pointers?
-    double lmsd;
-    bool abort_search;
-
-    QSearchManager(QMatrix<double>& dm_init);  // was QSearchTreeMaster *qsearch_treemaster_new(QMatrix<double> & dm);
+    std::vector< std::unique_ptr< QSearchFullTreeT<M> > > live;    // the buckets, updated by the search
+    std::vector< std::unique_ptr< QSearchTreeT<M> > > forest;     // QSearchTree of each bucket, null until asked for by bucket_tree()
+    M&  dm; 
+    std::vector< QSearchObserverT<M> > obs;  // vector of pointers?
+    std::atomic< double > lmsd;
+    std::atomic< bool > abort_search;
+    std::unique_ptr< QSearchThreadPool > pool;  // runs the buckets and the tries of each bucket
+    QSearchRandom rng;                          // every random choice of the search derives from this
+
+    // published by each bucket after every attempt, read by is_done()
+    std::unique_ptr< std::atomic< double >[] > scores;
+    QSearchNotifier* notifier;                  // set while find_best_tree runs
+    std::atomic< uint64_t > moves;              // Metropolis moves tried, over all threads
+
+    QSearchManagerT(M& dm_init);  // was QSearchTreeMaster *qsearch_treemaster_new(QMatrix<double> & dm);
+    // reproducible search; the quartet bounds are computed here already, on thread_count threads
+    // (0 = one per hardware thread)
+    QSearchManagerT(M& dm_init, uint64_t seed, unsigned int thread_count = 0);
     // destructor probably not needed - was void qsearch_treemaster_free(QSearchTreeMaster *clt);
 
-    void add_observer( start_fn tree_search_started, improve_fn tried_to_improve, done_fn tree_search_done);
-    void try_to_improve_bucket(unsigned int i);
-    QSearchTree find_best_tree(); 
+    void add_observer( start_fn tree_search_started, improve_fn_t<M> tried_to_improve, done_fn_t<M> tree_search_done);
+    void set_thread_count(unsigned int thread_count);   // 0 = one per hardware thread
+    void try_to_improve_bucket(unsigned int i, QSearchRandom& bucket_rng);
+    QSearchTreeT<M>& bucket_tree(unsigned int i);
+    QSearchTreeT<M> find_best_tree(); 
+    // searches by replica exchange from bucket 0 instead; observers see every better tree and
+    // bucket 0 ends up holding the best one
+    QSearchTreeT<M> find_best_tree_tempering(const QSearchTemperingOptions& options = QSearchTemperingOptions());
     bool was_search_stopped();
     void stop_search();
     double get_lmsd();
@@ -59,6 +102,11 @@ struct QSearchManager
 
 };
 
+typedef QSearchManagerT< QMatrix<double> > QSearchManager;
+typedef QSearchManagerT< QMatrix<float> >  QSearchManagerFloat;
+typedef QSearchManagerT< QSymmetricMatrix<double> > QSearchManagerPacked;
+typedef QSearchManagerT< QSymmetricMatrix<float> >  QSearchManagerPackedFloat;
+
 
 
 #endif //__QSEARCH_MANAGER_H
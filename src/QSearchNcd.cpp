@@ -0,0 +1,106 @@
+#include "QSearchNcd.hpp"
+#include "QSearchThreadPool.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+// labels go into a space separated matrix file
+static std::string matrix_label(std::string s)
+{
+    std::replace_if( s.begin(), s.end(), [](char c) { return isspace((unsigned char)c); }, '_' );
+    return s;
+}
+
+bool read_ncd_files( std::vector< NcdObject >& objects, const StringList& filenames )
+{
+    for (auto& filename : filenames) {
+        NcdObject o;
+        if (!read_whole_file( o.data, filename )) return false;
+        size_t slash = filename.find_last_of("/\\");
+        o.label = matrix_label( remove_extension( slash == std::string::npos ? filename : filename.substr(slash + 1) ) );
+        objects.push_back( std::move(o) );
+    }
+    return true;
+}
+
+bool read_fasta( std::vector< NcdObject >& objects, const std::string& filename )
+{
+    std::string s;
+    if (!read_whole_file( s, filename )) return false;
+    StringList lines;
+    segment_string( lines, s, '\n' );
+    for (auto& line : lines) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        if (line[0] == '>') {
+            NcdObject o;
+            size_t end = line.find_first_of(" \t", 1);
+            o.label = matrix_label( line.substr(1, end == std::string::npos ? std::string::npos : end - 1) );
+            objects.push_back( std::move(o) );
+        }
+        else if (!objects.empty()) objects.back().data += line;
+    }
+    return true;
+}
+
+double QSearchNcd::ncd(size_t cx, size_t cy, size_t cxy)
+{
+    double lo = std::min(cx, cy), hi = std::max(cx, cy);
+    return hi == 0 ? 0.0 : ( cxy - lo ) / hi;
+}
+
+void QSearchNcd::compute(QMatrix<double>& dm, const std::vector< NcdObject >& objects)
+{
+    dm.resize(0);
+    dm.labels.clear();
+    extend(dm, objects);
+}
+
+bool QSearchNcd::extend(QMatrix<double>& dm, const std::vector< NcdObject >& objects)
+{
+    const unsigned int old_dim = dm.dim, n = objects.size();
+    if (old_dim > n || (old_dim > 0 && dm.labels.size() != old_dim)) return false;
+    for (unsigned int i = 0; i < old_dim; i++)
+        if (dm.labels[i] != objects[i].label) return false;
+    dm.resize(n);
+    for (unsigned int i = old_dim; i < n; i++) dm.labels.push_back( objects[i].label );
+
+    const std::string id = compressor.name();
+    hashes.assign(cache ? n : 0, std::string());
+    single.assign(n, 0);
+    auto compress_single = [&](unsigned int i) {
+        if (cache) {
+            hashes[i] = QSearchNcdCache::content_hash( objects[i].data );
+            std::string key = QSearchNcdCache::single_key( id, hashes[i] );
+            if (cache->find( key, single[i] )) return;
+            single[i] = compressor.compressed_size( objects[i].data );
+            cache->store( key, single[i] );
+        }
+        else single[i] = compressor.compressed_size( objects[i].data );
+    };
+    if (pool) pool->parallel_for(n, compress_single);
+    else for (unsigned int i = 0; i < n; i++) compress_single(i);
+
+    // row i does the pairs (i, j > i) not already in the matrix; rows get shorter, the pool
+    // hands them out in order. x is compressed once per row, unless the cache has every
+    // partner, and each partner resumes from there.
+    auto compress_row = [&](unsigned int i) {
+        dm.at(i, i) = 0.0;
+        std::unique_ptr< QSearchPrimedCompressor > primed;
+        for (unsigned int j = std::max( i + 1, old_dim ); j < n; j++) {
+            size_t cxy;
+            std::string key;
+            if (cache) key = QSearchNcdCache::pair_key( id, hashes[i], hashes[j] );
+            if (!cache || !cache->find( key, cxy )) {
+                if (!primed) primed = compressor.prime( objects[i].data );
+                cxy = primed->compressed_size( objects[j].data );
+                if (cache) cache->store( key, cxy );
+            }
+            dm.at(i, j) = dm.at(j, i) = ncd( single[i], single[j], cxy );
+        }
+    };
+    if (pool) pool->parallel_for(n, compress_row);
+    else for (unsigned int i = 0; i < n; i++) compress_row(i);
+    if (cache) cache->save();
+    return true;
+}
@@ -0,0 +1,47 @@
+#ifndef __QSEARCH_NCD_HPP
+#define __QSEARCH_NCD_HPP
+
+#include <vector>
+#include <string>
+#include "SimpleMatrix.hpp"
+#include "QSearchCompressor.hpp"
+#include "QSearchNcdCache.hpp"
+
+class QSearchThreadPool;
+
+// One object of an NCD matrix: a whole file or one FASTA record
+struct NcdObject {
+    std::string label;
+    std::string data;
+};
+
+// Every file is one object, labelled with its name without directory and extension
+bool read_ncd_files( std::vector< NcdObject >& objects, const StringList& filenames );
+// Every record is one object, labelled with the first word of its header line.
+// Line breaks inside a sequence are dropped.
+bool read_fasta( std::vector< NcdObject >& objects, const std::string& filename );
+
+// Normalized compression distance matrices, computed like the browser worker does:
+// NCD(x,y) = (C(xy) - min(C(x),C(y))) / max(C(x),C(y)) with C(xy) compressing x then y as one
+// stream for x before y, whether the compressor resumes a stream primed with x or starts over,
+// mirrored into a symmetric matrix with a zero diagonal. Rows are spread over the pool.
+// With a cache, sizes found there are not compressed again and new ones are saved to it.
+struct QSearchNcd {
+    const QSearchCompressor& compressor;
+    QSearchThreadPool* pool;
+    QSearchNcdCache* cache;
+    std::vector< size_t > single;       // C(x) of every object, filled in by extend()
+    std::vector< std::string > hashes;  // content hash of every object, when there is a cache
+
+    QSearchNcd(const QSearchCompressor& compressor_init, QSearchThreadPool* pool_init = nullptr, QSearchNcdCache* cache_init = nullptr)
+        : compressor(compressor_init), pool(pool_init), cache(cache_init) {}
+
+    void compute(QMatrix<double>& dm, const std::vector< NcdObject >& objects);
+    // dm already holds the matrix of the first dm.dim objects, with their labels in order.
+    // It grows to all of them in place: only the pairs with a new object are compressed,
+    // k new objects cost O(k n). False, leaving dm alone, if the labels do not match.
+    bool extend(QMatrix<double>& dm, const std::vector< NcdObject >& objects);
+    static double ncd(size_t cx, size_t cy, size_t cxy);
+};
+
+#endif // __QSEARCH_NCD_HPP
@@ -0,0 +1,97 @@
+#include "QSearchNcdCache.hpp"
+#include "StringTools.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+// as made by content_hash
+static bool is_hash(const std::string& field)
+{
+    return field.size() == 32 && field.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+QSearchNcdCache::QSearchNcdCache(const std::string& filename_init) : filename(filename_init)
+{
+    std::string s;
+    if (!std::ifstream( filename )) return;     // no cache yet
+    if (!read_whole_file( s, filename )) return;
+    StringList lines;
+    segment_string( lines, s, '\n' );
+    if (!s.empty() && s.back() != '\n' && !lines.empty()) lines.pop_back();   // cut short while written
+    for (auto& line : lines) {
+        size_t last = line.find_last_of(' ');
+        if (last == std::string::npos || last + 1 == line.size()) continue;
+        StringList fields;
+        segment_string( fields, line, ' ' );
+        if (fields.size() != 3 && fields.size() != 4) continue;
+        if (!is_hash(fields[1]) || (fields.size() == 4 && !is_hash(fields[2]))) continue;
+        char* end;
+        unsigned long long size = strtoull( line.c_str() + last + 1, &end, 10 );
+        if (*end != '\0') continue;
+        sizes[ line.substr(0, last) ] = size;
+    }
+}
+
+bool QSearchNcdCache::find(const std::string& key, size_t& size)
+{
+    std::lock_guard< std::mutex > hold(lock);
+    auto it = sizes.find(key);
+    if (it == sizes.end()) return false;
+    size = it->second;
+    return true;
+}
+
+void QSearchNcdCache::store(const std::string& key, size_t size)
+{
+    std::lock_guard< std::mutex > hold(lock);
+    if (!sizes.emplace(key, size).second) return;
+    unsaved += key + " " + std::to_string(size) + "\n";
+}
+
+bool QSearchNcdCache::save()
+{
+    std::lock_guard< std::mutex > hold(lock);
+    if (unsaved.empty()) return true;
+    std::ofstream ofs( filename, std::ios_base::binary | std::ios_base::app );
+    ofs << unsaved;
+    if (!ofs.flush()) {
+        std::cerr << "cannot write cache file " << filename << "\n";
+        return false;
+    }
+    unsaved.clear();
+    return true;
+}
+
+// splitmix64 finalizer
+static uint64_t mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+std::string QSearchNcdCache::content_hash(std::string_view data)
+{
+    // two lanes fed the same words in different ways, each word fully mixed in
+    uint64_t a = mix( 0x243f6a8885a308d3ull ^ data.size() ), b = mix( 0x13198a2e03707344ull + data.size() );
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t w;
+        memcpy( &w, data.data() + i, 8 );
+        a = mix( a ^ w );
+        b = mix( b + w * 0x9e3779b97f4a7c15ull );
+    }
+    uint64_t tail = 0;
+    memcpy( &tail, data.data() + i, data.size() - i );
+    a = mix( a ^ tail ^ 0xa4093822299f31d0ull );
+    b = mix( b + tail * 0x9e3779b97f4a7c15ull + 0x082efa98ec4e6c89ull );
+
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(32, '0');
+    for (int k = 0; k < 16; k++) {
+        hex[15 - k] = digits[ (a >> (4 * k)) & 15 ];
+        hex[31 - k] = digits[ (b >> (4 * k)) & 15 ];
+    }
+    return hex;
+}
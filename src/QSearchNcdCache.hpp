@@ -0,0 +1,37 @@
+#ifndef __QSEARCH_NCD_CACHE_HPP
+#define __QSEARCH_NCD_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <cstddef>
+
+// Compressed sizes kept on disk between runs, so regenerating a matrix only compresses what is new.
+// Entries are keyed by compressor name and content hashes, never by file name: a changed file
+// simply misses. The file is plain text, one entry per line, and only ever appended to:
+//     <compressor> <hash x> <size>              C(x)
+//     <compressor> <hash x> <hash y> <size>     C(xy), x first
+// Lookups and stores may come from several threads.
+struct QSearchNcdCache {
+    std::string filename;
+    std::unordered_map< std::string, size_t > sizes;
+    std::string unsaved;    // entries stored since the last save(), as file lines
+    std::mutex lock;
+
+    // reads the file if there is one; lines cut short by an interrupted run are skipped
+    explicit QSearchNcdCache(const std::string& filename_init);
+
+    bool find(const std::string& key, size_t& size);
+    void store(const std::string& key, size_t size);
+    bool save();    // appends the unsaved entries to the file
+
+    // 128 bit hash of the content as 32 hex digits; not cryptographic, just wide enough
+    // that two different inputs will not meet by chance
+    static std::string content_hash(std::string_view data);
+    static std::string single_key(const std::string& compressor, const std::string& hx) { return compressor + " " + hx; }
+    static std::string pair_key(const std::string& compressor, const std::string& hx, const std::string& hy)
+        { return compressor + " " + hx + " " + hy; }
+};
+
+#endif // __QSEARCH_NCD_CACHE_HPP
@@ -2,34 +2,19 @@
 #include <cassert>
 #include <iostream>
 
-unsigned int QSearchNeighborList::operator[](const unsigned int& i) const { return n[i]; }
-
-int QSearchNeighborList::size() const { return n.size(); }
-
-void QSearchNeighborList::clear() { n.clear(); }
-
-int QSearchNeighborList::find_index(const unsigned int& w)
-{
-  for( int i = 0; i<n.size(); i++) if (n[i] == w) return i;
-  return -1;
-}
-
-bool QSearchNeighborList::has_neighbor(const unsigned int& w)
-{
-  return find_index(w) != -1;
-}
-
 void QSearchNeighborList::remove_neighbor(const unsigned int& w)
 {
-  assert(has_neighbor(w));
-  n.erase( n.begin() + find_index(w) );
+  int i = find_index(w);
+  assert(i != -1);
+  for ( --count; i < count; i++ ) n[i] = n[i+1];
 }
 
 void QSearchNeighborList::add_neighbor(const unsigned int& w)
 {
   assert( w != 4294967295 );
   assert(has_neighbor(w) == false);
-  n.push_back(w);
+  assert(count < MAX_NEIGHBORS);
+  n[count++] = w;
 }
 
 /*
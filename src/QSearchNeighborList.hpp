@@ -3,23 +3,33 @@
 
 #include <vector>
 
+// Neighbours of one node of a ternary tree. Nodes have at most 3 neighbours, so they are
+// kept inline; QSearchTree stores every connection on both of its nodes.
 class QSearchNeighborList {
-    std::vector< unsigned int > n; // list of unsigned int neighbors
+    public:
+    static const int MAX_NEIGHBORS = 3;
+
+    private:
+    unsigned int n[MAX_NEIGHBORS]; // list of unsigned int neighbors
+    int count;
 
     public:
 
-    QSearchNeighborList() {}
-    QSearchNeighborList(const QSearchNeighborList& q ) : n(q.n) {}
+    QSearchNeighborList() : count(0) {}
+    QSearchNeighborList(const QSearchNeighborList& q ) = default;
 
     // read but not write access via square bracket operator
-    unsigned int operator [](const unsigned int& i) const;
+    unsigned int operator [](const unsigned int& i) const { return n[i]; }
 
-    int size() const;
-    void clear();
+    int size() const { return count; }
+    void clear() { count = 0; }
     void add_neighbor(const unsigned int& w);
     void remove_neighbor(const unsigned int& w);
-    bool has_neighbor(const unsigned int& w);
-    int find_index(const unsigned int& w);
+    bool has_neighbor(const unsigned int& w) const { return find_index(w) != -1; }
+    int find_index(const unsigned int& w) const {
+        for( int i = 0; i < count; i++) if (n[i] == w) return i;
+        return -1;
+    }
 };
 
-#endif // __QSEARCH_NEIGHBOR_LIST_HPP
\ No newline at end of file
+#endif // __QSEARCH_NEIGHBOR_LIST_HPP
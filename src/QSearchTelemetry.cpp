@@ -0,0 +1,146 @@
+#include "QSearchTelemetry.hpp"
+
+#include <mutex>
+#include <sstream>
+#include <algorithm>
+
+static const char* const PHASE_NAMES[PHASE_COUNT] = {
+    "find_best_tree", "find_better_tree", "evaluate", "swap_nodes", "to_searchtree", "score_tree"
+};
+static const char* const MOVE_NAMES[MOVE_TYPE_COUNT] = { "swap", "transfer", "exchange" };
+
+// Counters of live threads, the totals of threads gone and where the last reset left them.
+// Never freed: threads may still end while static objects are destroyed.
+struct TelemetryRegistry {
+    std::mutex lock;
+    std::vector< QSearchTelemetryCounters* > live;
+    QSearchStats retired, baseline;
+    std::chrono::steady_clock::time_point start;
+    std::vector< std::pair< double, double > > trace;
+    uint64_t improvements;
+
+    TelemetryRegistry() : start(std::chrono::steady_clock::now()), improvements(0) {}
+};
+
+static TelemetryRegistry& registry()
+{
+    static TelemetryRegistry* r = new TelemetryRegistry();
+    return *r;
+}
+
+QSearchTelemetryCounters::QSearchTelemetryCounters()
+{
+    for (auto& c : proposed) c = 0;
+    for (auto& c : accepted) c = 0;
+    for (auto& c : accept_histogram) c = 0;
+    for (auto& c : calls) c = 0;
+    for (auto& c : nanos) c = 0;
+}
+
+static void add_counters(QSearchStats& s, const QSearchTelemetryCounters& c)
+{
+    for (unsigned int t = 0; t < MOVE_TYPE_COUNT; t++) {
+        s.proposed[t] += c.proposed[t].load(std::memory_order_relaxed);
+        s.accepted[t] += c.accepted[t].load(std::memory_order_relaxed);
+    }
+    for (unsigned int b = 0; b < ACCEPT_HISTOGRAM_BINS; b++) s.accept_histogram[b] += c.accept_histogram[b].load(std::memory_order_relaxed);
+    for (unsigned int p = 0; p < PHASE_COUNT; p++) {
+        s.calls[p] += c.calls[p].load(std::memory_order_relaxed);
+        s.phase_seconds[p] += c.nanos[p].load(std::memory_order_relaxed) * 1e-9;
+    }
+}
+
+QSearchTelemetryWorker::QSearchTelemetryWorker()
+{
+    TelemetryRegistry& r = registry();
+    std::lock_guard< std::mutex > l(r.lock);
+    r.live.push_back(&counters);
+}
+
+QSearchTelemetryWorker::~QSearchTelemetryWorker()
+{
+    TelemetryRegistry& r = registry();
+    std::lock_guard< std::mutex > l(r.lock);
+    add_counters(r.retired, counters);
+    r.live.erase( std::remove( r.live.begin(), r.live.end(), &counters ), r.live.end() );
+}
+
+QSearchStats::QSearchStats() : enabled(false), seconds(0.0), improvements(0)
+{
+    std::fill( std::begin(proposed), std::end(proposed), 0 );
+    std::fill( std::begin(accepted), std::end(accepted), 0 );
+    std::fill( std::begin(accept_histogram), std::end(accept_histogram), 0 );
+    std::fill( std::begin(calls), std::end(calls), 0 );
+    std::fill( std::begin(phase_seconds), std::end(phase_seconds), 0.0 );
+}
+
+// all counts so far, from every thread that ever counted; the caller holds the lock
+static QSearchStats total(TelemetryRegistry& r)
+{
+    QSearchStats s = r.retired;
+    for (auto c : r.live) add_counters(s, *c);
+    return s;
+}
+
+// Counters are never cleared, other threads may be writing them: a reset remembers the totals
+// and snapshots subtract them.
+void telemetry_reset()
+{
+    TelemetryRegistry& r = registry();
+    std::lock_guard< std::mutex > l(r.lock);
+    r.baseline = total(r);
+    r.start = std::chrono::steady_clock::now();
+    r.trace.clear();
+    r.improvements = 0;
+}
+
+QSearchStats telemetry_snapshot()
+{
+    TelemetryRegistry& r = registry();
+    std::lock_guard< std::mutex > l(r.lock);
+    QSearchStats s = total(r);
+    for (unsigned int t = 0; t < MOVE_TYPE_COUNT; t++) {
+        s.proposed[t] -= r.baseline.proposed[t];
+        s.accepted[t] -= r.baseline.accepted[t];
+    }
+    for (unsigned int b = 0; b < ACCEPT_HISTOGRAM_BINS; b++) s.accept_histogram[b] -= r.baseline.accept_histogram[b];
+    for (unsigned int p = 0; p < PHASE_COUNT; p++) {
+        s.calls[p] -= r.baseline.calls[p];
+        s.phase_seconds[p] -= r.baseline.phase_seconds[p];
+    }
+#ifdef QSEARCH_TELEMETRY
+    s.enabled = true;
+#endif
+    s.seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - r.start ).count();
+    s.improvements = r.improvements;
+    s.trace = r.trace;
+    return s;
+}
+
+// rare next to moves, so a lock will do
+void telemetry_improvement(double score)
+{
+    TelemetryRegistry& r = registry();
+    std::lock_guard< std::mutex > l(r.lock);
+    r.improvements++;
+    if (r.trace.empty() || score > r.trace.back().second)
+        r.trace.push_back( std::make_pair( std::chrono::duration< double >( std::chrono::steady_clock::now() - r.start ).count(), score ) );
+}
+
+std::string QSearchStats::to_json() const
+{
+    std::ostringstream oss;
+    oss.precision(9);
+    oss << "{\n  \"enabled\": " << (enabled ? "true" : "false") << ",\n  \"seconds\": " << seconds << ",\n  \"moves\": {";
+    for (unsigned int t = 0; t < MOVE_TYPE_COUNT; t++)
+        oss << (t ? ", " : " ") << "\"" << MOVE_NAMES[t] << "\": { \"proposed\": " << proposed[t] << ", \"accepted\": " << accepted[t] << " }";
+    oss << " },\n  \"accept_histogram\": [";
+    for (unsigned int b = 0; b < ACCEPT_HISTOGRAM_BINS; b++) oss << (b ? ", " : " ") << accept_histogram[b];
+    oss << " ],\n  \"improvements\": " << improvements << ",\n  \"phases\": {";
+    for (unsigned int p = 0; p < PHASE_COUNT; p++)
+        oss << (p ? "," : "") << "\n    \"" << PHASE_NAMES[p] << "\": { \"calls\": " << calls[p] << ", \"seconds\": " << phase_seconds[p] << " }";
+    oss << "\n  },\n  \"trace\": [";
+    for (size_t i = 0; i < trace.size(); i++) oss << (i ? ", " : " ") << "[" << trace[i].first << ", " << trace[i].second << "]";
+    oss << " ]\n}\n";
+    return oss.str();
+}
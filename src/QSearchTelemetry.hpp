@@ -0,0 +1,136 @@
+#ifndef __QSEARCH_TELEMETRY_HPP
+#define __QSEARCH_TELEMETRY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Search telemetry: moves proposed and accepted per type, how likely the proposals were to be
+// taken, improvements of the search and time spent per phase. Every thread counts into its own
+// block, telemetry_snapshot() adds them up. Built in with QSEARCH_TELEMETRY (cmake option of the
+// same name), otherwise the macros below compile to nothing and snapshots stay empty.
+
+enum QSearchPhase {
+    PHASE_FIND_BEST_TREE,       // the whole search, bucket or tempering
+    PHASE_FIND_BETTER_TREE,     // one bucket attempt
+    PHASE_EVALUATE,             // scoring a proposed move without applying it
+    PHASE_SWAP_NODES,
+    PHASE_TO_SEARCHTREE,
+    PHASE_SCORE_TREE,           // full O(n^3) scores, cached ones are not counted
+    PHASE_COUNT
+};
+
+enum QSearchMoveType {
+    MOVE_SWAP,
+    MOVE_TRANSFER,
+    MOVE_EXCHANGE,      // trees traded between tempering replicas
+    MOVE_TYPE_COUNT
+};
+
+const unsigned int ACCEPT_HISTOGRAM_BINS = 10;
+
+// One thread's counts. Only the owning thread writes them, so a relaxed load and store is enough
+// for an increment; other threads only read.
+struct QSearchTelemetryCounters {
+    std::atomic< uint64_t > proposed[MOVE_TYPE_COUNT];
+    std::atomic< uint64_t > accepted[MOVE_TYPE_COUNT];
+    std::atomic< uint64_t > accept_histogram[ACCEPT_HISTOGRAM_BINS];    // proposals by acceptance probability
+    std::atomic< uint64_t > calls[PHASE_COUNT];
+    std::atomic< uint64_t > nanos[PHASE_COUNT];     // inclusive, summed over threads
+
+    QSearchTelemetryCounters();
+
+    static void add(std::atomic< uint64_t >& c, uint64_t n) {
+        c.store( c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed );
+    }
+    void count_move(QSearchMoveType type, double probability, bool accept) {
+        add( proposed[type], 1 );
+        if (accept) add( accepted[type], 1 );
+        unsigned int bin = probability >= 1.0 ? ACCEPT_HISTOGRAM_BINS - 1 : (unsigned int)( probability * ACCEPT_HISTOGRAM_BINS );
+        add( accept_histogram[bin], 1 );
+    }
+};
+
+// registers the calling thread's counters on first use, folds them into the totals when it ends
+struct QSearchTelemetryWorker {
+    QSearchTelemetryCounters counters;
+    QSearchTelemetryWorker();
+    ~QSearchTelemetryWorker();
+};
+
+inline QSearchTelemetryCounters& telemetry_counters()
+{
+    thread_local QSearchTelemetryWorker worker;
+    return worker.counters;
+}
+
+struct QSearchPhaseTimer {
+    QSearchPhase phase;
+    std::chrono::steady_clock::time_point start;
+
+    explicit QSearchPhaseTimer(QSearchPhase phase_init) : phase(phase_init), start(std::chrono::steady_clock::now()) {}
+    ~QSearchPhaseTimer() {
+        QSearchTelemetryCounters& c = telemetry_counters();
+        QSearchTelemetryCounters::add( c.calls[phase], 1 );
+        QSearchTelemetryCounters::add( c.nanos[phase],
+            std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now() - start ).count() );
+    }
+};
+
+// For kernels too short to read the clock around every call: counts every call, times one in
+// SAMPLE_EVERY and scales that up
+struct QSearchSampledPhaseTimer {
+    static const uint64_t SAMPLE_EVERY = 64;
+    QSearchTelemetryCounters& c;
+    QSearchPhase phase;
+    bool timed;
+    std::chrono::steady_clock::time_point start;
+
+    explicit QSearchSampledPhaseTimer(QSearchPhase phase_init)
+        : c(telemetry_counters()), phase(phase_init), timed(c.calls[phase].load(std::memory_order_relaxed) % SAMPLE_EVERY == 0) {
+        if (timed) start = std::chrono::steady_clock::now();
+    }
+    ~QSearchSampledPhaseTimer() {
+        QSearchTelemetryCounters::add( c.calls[phase], 1 );
+        if (timed) QSearchTelemetryCounters::add( c.nanos[phase], SAMPLE_EVERY *
+            std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now() - start ).count() );
+    }
+};
+
+// Everything counted since the last telemetry_reset()
+struct QSearchStats {
+    bool enabled;               // built with QSEARCH_TELEMETRY
+    double seconds;             // since the reset
+    uint64_t proposed[MOVE_TYPE_COUNT];
+    uint64_t accepted[MOVE_TYPE_COUNT];
+    uint64_t accept_histogram[ACCEPT_HISTOGRAM_BINS];
+    uint64_t calls[PHASE_COUNT];
+    double phase_seconds[PHASE_COUNT];
+    uint64_t improvements;
+    std::vector< std::pair< double, double > > trace;   // (seconds, score) whenever the best score rose
+
+    QSearchStats();
+    std::string to_json() const;
+};
+
+void telemetry_reset();
+QSearchStats telemetry_snapshot();
+// a search found a better tree, of this score
+void telemetry_improvement(double score);
+
+#ifdef QSEARCH_TELEMETRY
+#define QSEARCH_COUNT_MOVE(type, probability, accept) telemetry_counters().count_move( (type), (probability), (accept) )
+#define QSEARCH_COUNT_IMPROVEMENT(score) telemetry_improvement( (score) )
+#define QSEARCH_TIME_PHASE(phase) QSearchPhaseTimer qsearch_phase_timer_( (phase) )
+#define QSEARCH_SAMPLE_PHASE(phase) QSearchSampledPhaseTimer qsearch_phase_timer_( (phase) )
+#else
+#define QSEARCH_COUNT_MOVE(type, probability, accept) ((void)0)
+#define QSEARCH_COUNT_IMPROVEMENT(score) ((void)0)
+#define QSEARCH_TIME_PHASE(phase) ((void)0)
+#define QSEARCH_SAMPLE_PHASE(phase) ((void)0)
+#endif
+
+#endif // __QSEARCH_TELEMETRY_HPP
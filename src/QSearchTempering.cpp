@@ -0,0 +1,106 @@
+#include "QSearchTempering.hpp"
+#include "QSearchThreadPool.hpp"
+#include "QSearchTelemetry.hpp"
+
+#include <cmath>
+#include <algorithm>
+
+template<class M> QSearchTemperingT<M>::QSearchTemperingT(const QSearchFullTreeT<M>& start, const QSearchTemperingOptions& options_init, QSearchRandom rng_init)
+    : options(options_init), rng(rng_init), rounds(0), moves(0)
+{
+    options.replicas = std::max( options.replicas, 2u );
+    const unsigned int K = options.replicas;
+    for (unsigned int k = 0; k < K; k++) {
+        replicas.push_back( std::unique_ptr< QSearchFullTreeT<M> >( new QSearchFullTreeT<M>(start) ) );
+        replicas.back()->reserve_scratch();
+        replica_rng.push_back( rng.split() );
+    }
+    start.snapshot(best);
+    replica_best.resize(K);
+    tried.assign(K - 1, 0);
+    accepted.assign(K - 1, 0);
+
+    // The scale is the typical size of a move on the start tree: the hottest replica takes such
+    // a move uphill about one time in three, the coldest only the last small steps near an optimum
+    QSearchFullTreeT<M>& probe = *replicas[0];
+    double scale = 0.0;
+    unsigned int counted = 0;
+    for (unsigned int i = 0; i < 64; i++) {
+        unsigned int a, b;
+        probe.random_pair(a, b, rng);
+        double d = fabs( probe.evaluate_swap(a, b) );
+        if (d > 0) { scale += d; counted++; }
+    }
+    probe.pair_next = probe.PAIR_BATCH;
+    scale = counted ? scale / counted : std::max( fabs(start.raw_score) * 1e-9, 1e-12 );
+    const double cold = scale / 1000, hot = scale;
+    beta.resize(K);
+    for (unsigned int k = 0; k < K; k++) beta[k] = 1.0 / ( cold * pow( hot / cold, (double)k / (K - 1) ) );
+}
+
+template<class M> bool QSearchTemperingT<M>::round(QSearchThreadPool* pool)
+{
+    const unsigned int K = replicas.size();
+    const unsigned int steps = options.sweep ? options.sweep : replicas[0]->node_count;
+    const bool refresh = rounds > 0 && rounds % options.adapt_rounds == 0;
+    for (auto& b : replica_best) b = best;   // replicas save only shapes better than any so far
+
+    auto sweep = [&](unsigned int k) {
+        if (refresh) replicas[k]->refresh();    // drop the rounding drift of the incremental sums
+        replicas[k]->metropolis(steps, beta[k], replica_rng[k], replica_best[k]);
+    };
+    if (pool) pool->parallel_for(K, sweep);
+    else for (unsigned int k = 0; k < K; k++) sweep(k);
+    moves += (uint64_t)K * steps;
+
+    bool improved = false;
+    for (auto& b : replica_best)
+        if (b.raw_score < best.raw_score) {
+            best = b;
+            improved = true;
+        }
+
+    // even pairs one round, odd pairs the next; the colder replica takes the lower score with
+    // probability min(1, exp((beta_k - beta_k+1) (E_k - E_k+1)))
+    for (unsigned int k = rounds % 2; k + 1 < K; k += 2) {
+        double x = ( beta[k] - beta[k+1] ) * ( replicas[k]->raw_score - replicas[k+1]->raw_score );
+        tried[k]++;
+        bool accept = x >= 0 || rng.uniform() < exp(x);
+        QSEARCH_COUNT_MOVE(MOVE_EXCHANGE, exp( std::min( x, 0.0 ) ), accept);
+        if (accept) {
+            accepted[k]++;
+            std::swap( replicas[k], replicas[k+1] );
+            std::swap( replica_rng[k], replica_rng[k+1] );
+        }
+    }
+
+    rounds++;
+    if (rounds % options.adapt_rounds == 0) adapt_ladder();
+    return improved;
+}
+
+template<class M> double QSearchTemperingT<M>::exchange_rate(const unsigned int& k) const
+{
+    return tried[k] ? (double)accepted[k] / tried[k] : 0.0;
+}
+
+// Gaps are kept on a log scale above the fixed coldest temperature. A pair exchanging more often
+// than the target is closer than it needs to be and moves apart, and the other way round.
+template<class M> void QSearchTemperingT<M>::adapt_ladder()
+{
+    const unsigned int K = replicas.size();
+    std::vector< double > gap(K - 1);
+    for (unsigned int k = 0; k + 1 < K; k++) {
+        gap[k] = log( beta[k] / beta[k+1] );
+        if (tried[k]) gap[k] *= exp( 2.0 * ( exchange_rate(k) - options.target_rate ) );
+        gap[k] = std::min( std::max( gap[k], 1e-3 ), 5.0 );
+    }
+    for (unsigned int k = 0; k + 1 < K; k++) beta[k+1] = beta[k] / exp( gap[k] );
+    std::fill( tried.begin(), tried.end(), 0 );
+    std::fill( accepted.begin(), accepted.end(), 0 );
+}
+
+template struct QSearchTemperingT< QMatrix<double> >;
+template struct QSearchTemperingT< QMatrix<float> >;
+template struct QSearchTemperingT< QSymmetricMatrix<double> >;
+template struct QSearchTemperingT< QSymmetricMatrix<float> >;
@@ -0,0 +1,55 @@
+#ifndef __QSEARCH_TEMPERING_HPP
+#define __QSEARCH_TEMPERING_HPP
+
+#include "QSearchFullTree.hpp"
+#include "RandTools.hpp"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+class QSearchThreadPool;
+
+struct QSearchTemperingOptions {
+    unsigned int replicas;      // trees on the ladder, at least 2
+    unsigned int sweep;         // moves per replica between exchanges, 0 = one per tree node
+    double target_rate;         // share of exchanges between neighbours the ladder adapts to
+    unsigned int adapt_rounds;  // rounds between ladder adjustments
+    unsigned int patience;      // rounds without a better tree before the search stops
+
+    QSearchTemperingOptions() : replicas(8), sweep(0), target_rate(0.25), adapt_rounds(16), patience(200) {}
+};
+
+// Replica exchange ("parallel tempering"). Copies of one tree run Metropolis moves at a ladder of
+// temperatures, on the pool, each with its own generator. After every sweep neighbours on the
+// ladder trade trees by the Metropolis exchange rule, so a tree caught in a local optimum at the
+// cold end can climb out through the hot end and come back down. The coldest temperature stays
+// put, the gaps above it widen or narrow towards options.target_rate accepted exchanges.
+// Results depend on the seed only, not on the number of threads.
+template<class M> struct QSearchTemperingT {
+    QSearchTemperingOptions options;
+    std::vector< std::unique_ptr< QSearchFullTreeT<M> > > replicas;   // coldest first
+    std::vector< QSearchRandom > replica_rng;   // travel with their tree on exchanges
+    std::vector< double > beta;                 // per ladder position, per unit of raw score
+    std::vector< unsigned int > tried, accepted;    // exchanges per neighbour pair since the last adjustment
+    std::vector< FullTreeSnapshot > replica_best;   // per ladder position
+    FullTreeSnapshot best;                      // best shape any replica met
+    QSearchRandom rng;                          // exchange decisions
+    unsigned int rounds;
+    uint64_t moves;                             // over all replicas
+
+    QSearchTemperingT(const QSearchFullTreeT<M>& start, const QSearchTemperingOptions& options, QSearchRandom rng);
+
+    // one sweep of every replica, then exchanges between every other neighbour pair;
+    // returns true when best improved
+    bool round(QSearchThreadPool* pool = nullptr);
+    double temperature(const unsigned int& k) const { return 1.0 / beta[k]; }
+    double exchange_rate(const unsigned int& k) const;  // pair (k, k+1) since the last adjustment
+
+    private:
+    void adapt_ladder();
+};
+
+typedef QSearchTemperingT< QMatrix<double> > QSearchTempering;
+
+#endif // __QSEARCH_TEMPERING_HPP
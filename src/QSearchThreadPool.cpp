@@ -0,0 +1,108 @@
+#include "QSearchThreadPool.hpp"
+#include <atomic>
+#include <exception>
+#include <algorithm>
+
+struct QSearchThreadPool::Job {
+    const unsigned int count;
+    const std::function< void (unsigned int) >& body;
+    std::atomic< unsigned int > next;     // next index to hand out
+    unsigned int finished;                // guarded by done_lock
+    std::exception_ptr error;             // guarded by done_lock
+    std::mutex done_lock;
+    std::condition_variable done;
+
+    Job(unsigned int count_init, const std::function< void (unsigned int) >& body_init)
+        : count(count_init), body(body_init), next(0), finished(0) {}
+};
+
+QSearchThreadPool::QSearchThreadPool(unsigned int thread_count) : stopping(false)
+{
+    if (thread_count == 0) thread_count = default_thread_count();
+    for (unsigned int i = 1; i < thread_count; i++)
+        workers.emplace_back( [this] { worker_loop(); } );
+}
+
+QSearchThreadPool::~QSearchThreadPool()
+{
+    {
+        std::lock_guard< std::mutex > l(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+unsigned int QSearchThreadPool::size() const
+{
+    return workers.size() + 1;
+}
+
+unsigned int QSearchThreadPool::default_thread_count()
+{
+#ifdef __EMSCRIPTEN__
+    return 1;
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+void QSearchThreadPool::run_job(Job& job)
+{
+    for (;;) {
+        unsigned int i = job.next.fetch_add(1);
+        if (i >= job.count) return;
+        std::exception_ptr error;
+        try { job.body(i); }
+        catch (...) { error = std::current_exception(); }
+
+        std::lock_guard< std::mutex > l(job.done_lock);
+        if (error && !job.error) job.error = error;
+        if (++job.finished == job.count) job.done.notify_all();
+    }
+}
+
+void QSearchThreadPool::retire_job(const std::shared_ptr< Job >& job)
+{
+    std::lock_guard< std::mutex > l(lock);
+    auto it = std::find(jobs.begin(), jobs.end(), job);
+    if (it != jobs.end()) jobs.erase(it);
+}
+
+void QSearchThreadPool::worker_loop()
+{
+    for (;;) {
+        std::shared_ptr< Job > job;
+        {
+            std::unique_lock< std::mutex > l(lock);
+            wake.wait(l, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;   // stopping
+            job = jobs.front();
+        }
+        run_job(*job);
+        retire_job(job);   // every index is handed out once run_job returns
+    }
+}
+
+void QSearchThreadPool::parallel_for(unsigned int count, const std::function< void (unsigned int) >& body)
+{
+    if (count == 0) return;
+    if (workers.empty() || count == 1) {
+        for (unsigned int i = 0; i < count; i++) body(i);
+        return;
+    }
+
+    auto job = std::make_shared< Job >(count, body);
+    {
+        std::lock_guard< std::mutex > l(lock);
+        jobs.push_back(job);
+    }
+    wake.notify_all();
+
+    run_job(*job);
+    retire_job(job);
+
+    std::unique_lock< std::mutex > l(job->done_lock);
+    job->done.wait(l, [&job] { return job->finished == job->count; });
+    if (job->error) std::rethrow_exception(job->error);
+}
@@ -0,0 +1,46 @@
+#ifndef __QSEARCH_THREAD_POOL_HPP
+#define __QSEARCH_THREAD_POOL_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Fixed set of worker threads running parallel loops for the search.
+// The thread calling parallel_for() works on its own loop until every index
+// is handed out, so loops may nest (a forest bucket running its tries) without
+// deadlocking the pool. A pool of size 1 has no workers and runs everything
+// on the caller, which is what the single-threaded web build uses.
+class QSearchThreadPool {
+    struct Job;
+
+    std::vector< std::thread > workers;
+    std::deque< std::shared_ptr< Job > > jobs;   // loops that may still have unclaimed indices
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+
+    void worker_loop();
+    void run_job(Job& job);
+    void retire_job(const std::shared_ptr< Job >& job);
+
+    public:
+
+    // thread_count counts the calling thread; 0 picks default_thread_count()
+    explicit QSearchThreadPool(unsigned int thread_count = 0);
+    QSearchThreadPool(const QSearchThreadPool&) = delete;
+    QSearchThreadPool& operator =(const QSearchThreadPool&) = delete;
+    ~QSearchThreadPool();
+
+    unsigned int size() const;
+    // calls body(i) for i in [0, count), returns when all calls are finished.
+    // The first exception thrown by body is rethrown here.
+    void parallel_for(unsigned int count, const std::function< void (unsigned int) >& body);
+
+    static unsigned int default_thread_count();
+};
+
+#endif // __QSEARCH_THREAD_POOL_HPP
@@ -2,14 +2,17 @@
 #include <cmath> 
 #include <cassert>
 #include <algorithm>
+#include <atomic>
 
 #include "RandTools.hpp"
 #include "QSearchNeighborList.hpp"
 #include "QSearchFullTree.hpp"
 #include "SimpleMatrix.hpp"
 #include "QSearchConnectedNode.hpp"
+#include "QSearchThreadPool.hpp"
+#include "QSearchTelemetry.hpp"
 
-QSearchTree::QSearchTree(QMatrix<double>& dm_init) 
+template<class M> QSearchTreeT<M>::QSearchTreeT(M& dm_init) 
   : dm( dm_init), 
     total_node_count(dm_init.dim * 2 - 2), 
     nodeflags(dm_init.dim * 2 - 2, 0),
@@ -31,6 +34,7 @@ QSearchTree::QSearchTree(QMatrix<double>& dm_init)
   }
   connect(dm.dim - 2, dm.dim);
   connect(dm.dim-1, total_node_count-1);
+  if (dm.quartet_bounds) calc_min_max();  // cheap once the matrix has them
 
   for(int i = 0; i < total_node_count; i += 1) {
     if (get_neighbor_count(i) == 1) {
@@ -39,15 +43,15 @@ QSearchTree::QSearchTree(QMatrix<double>& dm_init)
   }
 }
 
-QSearchTree::QSearchTree(const QSearchTree& q) : 
+template<class M> QSearchTreeT<M>::QSearchTreeT(const QSearchTreeT<M>& q) : 
   total_node_count(q.total_node_count), 
   must_recalculate_paths(true), 
-  dist_calculated(false),
+  dist_calculated(q.dist_calculated),
   score(q.score),
   spm(q.spm),
-  f_score_good(false), 
-  dist_min(0.0), 
-  dist_max(0.0),
+  f_score_good(q.f_score_good), 
+  dist_min(q.dist_min), 
+  dist_max(q.dist_max),
   ms(q.ms), 
   n(q.n),
   nodeflags(q.nodeflags),
@@ -57,152 +61,31 @@ QSearchTree::QSearchTree(const QSearchTree& q) :
   ms.total_clonings++; 
 }
 
-std::unique_ptr< QSearchTree > QSearchTree::find_better_tree(int howManyTries) 
+template<class M> std::unique_ptr< QSearchTreeT<M> > QSearchTreeT<M>::find_better_tree(int howManyTries, QSearchRandom& rng, QSearchThreadPool* pool) 
 {
-    if (!dist_calculated) {
-        calc_min_max();
-        dist_calculated = 1;
-    }
+  if (!dist_calculated) calc_min_max(pool);   // before the tries, which share the cached bounds
   
-  //QSearchTree result;
-  int i, totmuts;
-  double candscore;
-  double best_score;
   assert( this );
-  double curscore = score_tree();
-  std::unique_ptr< QSearchTree > cand, result;
-#if QSOPENMP_ENABLED
-  if (!g_thread_supported ()) g_thread_init (NULL);
-#pragma omp parallel shared(result, curscore) private(i, totmuts, cand, candscore, best_score) firstprivate(howManyTries, dm, clt)
- {
-#pragma omp for schedule (dynamic, 1)
-#else
-  howManyTries = 1;
-  do {
-#endif
-  for (i = 0; i < howManyTries; i += 1) {
-    cand.reset( new QSearchTree( *this ) );
-     
-    //qsearch_tree_complex_mutation(cand);
-    QSearchFullTree tree(*cand);
-
-    // perform node_count swaps, keep track of best
-    best_score = tree.raw_score;
-    totmuts = tree.node_count;//qsearch_tree_get_mutation_distribution_sample(clt);
-    
-    int j;
-     
-    for (j = 0; j < totmuts; ++j) {
-        double beta = 1.0; // set to 0.0 to mimick random behaviour. This behaviour is a metropolis markov chain
-         
-        unsigned int p1, p2;
-        tree.random_pair(p1, p2);
+  // the tries themselves run on copies of one QSearchFullTree, see QSearchFullTree::find_better_tree
+  QSearchFullTreeT<M> start(*this);
+  std::unique_ptr< QSearchFullTreeT<M> > better = start.find_better_tree(howManyTries, rng, pool);
+  if (!better) return nullptr;
 
-        double cur = tree.raw_score;
-
-        if ( rand_int(0, 2) < 2) { 
-            
-            tree.swap_nodes(p1, p2);
-            
-            if (tree.raw_score <= best_score || fabs(tree.raw_score - best_score) < 1e-6) { 
-                cand = tree.to_searchtree();
-                best_score = tree.raw_score;
-                //printf("Score improved from %f to %f, raw: %f \n", curscore, cand->score, tree.raw_score);
-            }
-
-            // calculate acceptance
-            double now = tree.raw_score;
-            if (rand1(gen) >= exp(beta * (cur-now) )) { // reject
-                tree.swap_nodes(p1, p2);
-            } 
-
-        } else { // transfer tree
-            
-            int interior = tree.move_to(p1, p2);
-            assert(interior != p2);
-             
-            int sibling = tree.find_sibling(p1, p2);
-           
-            // move entire subtree containing p1 and sibling in the place of p2 
-            tree.swap_nodes(interior, p2);
-            
-            if (tree.raw_score <= best_score || fabs(tree.raw_score - best_score) < 1e-6) { 
-                cand = tree.to_searchtree();
-                best_score = tree.raw_score;
-                //printf("Score improved from %f to %f, raw: %f \n", curscore, cand->score, tree.raw_score);
-            }
-            
-            // swap the sibling back in its original place (making 'node' a sibling of 'p2'
-            tree.swap_nodes(sibling, p2);
-           
-            // postcondition: 
-            assert( tree.find_sibling(p1, sibling) == p2);
-
-            if (tree.raw_score <= best_score || fabs(tree.raw_score - best_score) < 1e-6) { 
-                cand = tree.to_searchtree();
-                best_score = tree.raw_score;
-                //printf("Score improved from %f to %f, raw: %f \n", curscore, cand->score, tree.raw_score);
-            }
-            
-            // calculate acceptance
-            double now = tree.raw_score;
-            if (rand1(gen) >= exp(beta*(cur-now) )) { // reject
-                tree.swap_nodes(sibling, p2);
-                tree.swap_nodes(interior, p2);
-            } 
-        }
-    }
-    
-    //tree.to_searchtree(cand);
-    //qsearch_free_fulltree(tree);
-    
-    //cand->f_score_good = 0;
-    //double org = cand->score;
-    assert( cand.get() != NULL);
-    candscore  = cand->score_tree();
-    
-    //if (fabs(org-cand->score) > 1e-6) {
-    //    printf("Error, score should be %f, was %f\n", cand->score, org);
-    //    exit(0);
-    //}
-
-    if (candscore <= curscore) {
-      cand.reset();
-      continue;
-    }
-#if QSOPENMP_ENABLED
-#pragma omp critical
-#endif
-    if (candscore > curscore) {
-      if (result)
-      result.reset();
-      std::swap(result,cand);
-      curscore = candscore;
-      //std::cout << "Got better score " << curscore << std::endl;
-    }
-    else
-      cand.reset();
-    }
-#if QSOPENMP_ENABLED
-}
-#else
-  } while (0);
-#endif
-  return result;
+  return better->to_searchtree();
 }
 
-unsigned int QSearchTree::get_leaf_node_count()
+template<class M> unsigned int QSearchTreeT<M>::get_leaf_node_count()
 {
   return (total_node_count+2)/2;
 }
 
-unsigned int QSearchTree::get_kernel_node_count()
+template<class M> unsigned int QSearchTreeT<M>::get_kernel_node_count()
 {
   return (total_node_count-2)/2;
 }
 
 // possibly return unique pointer? call by reference?
-QMatrix< unsigned int> QSearchTree::get_adjacency_matrix()
+template<class M> QMatrix< unsigned int> QSearchTreeT<M>::get_adjacency_matrix()
 {
   QMatrix<unsigned int> m(total_node_count);
   int i, j;
@@ -217,38 +100,83 @@ QMatrix< unsigned int> QSearchTree::get_adjacency_matrix()
   return m;
 }
 
-void QSearchTree::calc_min_max() {
-  //std::cout << "\nQSearchTree::calc_min_max()\n";
-  //std::fflush( stdout );
+// Sums of the smallest and largest of the three quartet topology costs over all quartets
+// i<j<k<l. Rows i are handed out to the pool (most work first); for every (i,j,k) the l loop
+// keeps LANES independent partial sums so it vectorizes. Per-row results are added up in row
+// order, so the bounds do not depend on the number of threads. Only the upper triangle is
+// read, right of the diagonal, where both matrix types keep rows contiguous.
+template<class M> std::pair<double, double> quartet_bounds(const M& dm, QSearchThreadPool* pool)
+{
+  typedef typename M::value_type D;
+  const int LANES = 4;
+  const int lps = dm.dim;
+  std::vector< std::pair<double, double> > row_sums(lps, std::make_pair(0.0, 0.0));
+
+  auto row_task = [&](unsigned int i) {
+    const D* ui = dm.upper_row(i);    // ui[t] = d(i, i+1+t)
+    double mn[LANES] = { 0.0 }, mx[LANES] = { 0.0 };
+    for (int j = i+1; j < lps; j += 1) {
+      const D* uj = dm.upper_row(j);
+      const double dij = ui[j-i-1];
+      for (int k = j+1; k < lps; k += 1) {
+        // from l = k+1 on: d(k,l) at dk[t], d(j,l) at dj[t], d(i,l) at di[t], with t = l-k-1
+        const D* dk = dm.upper_row(k);
+        const D* dj = uj + (k-j);
+        const D* di = ui + (k-i);
+        const double dik = ui[k-i-1], djk = uj[k-j-1];
+        const int len = lps - k - 1;
+        int t = 0;
+        for (; t + LANES <= len; t += LANES) {
+          for (int v = 0; v < LANES; v += 1) {
+            double c1 = dij + dk[t+v];
+            double c2 = dik + dj[t+v];
+            double c3 = di[t+v] + djk;
+            double lo = c1 < c2 ? c1 : c2, hi = c1 < c2 ? c2 : c1;
+            mn[v] += lo < c3 ? lo : c3;
+            mx[v] += hi > c3 ? hi : c3;
+          }
+        }
+        for (; t < len; t += 1) {
+          double c1 = dij + dk[t], c2 = dik + dj[t], c3 = di[t] + djk;
+          mn[0] += std::min( { c1, c2, c3 } ); mx[0] += std::max( { c1, c2, c3 } );
+        }
+      }
+    }
+    for (int v = 0; v < LANES; v += 1) {
+      row_sums[i].first += mn[v];
+      row_sums[i].second += mx[v];
+    }
+  };
 
-  dist_min = 0.0;
-  dist_max = 0.0;
-  for (int i = 0; i < leaf_placement.size(); i += 1)
-      for (int j = i+1; j < leaf_placement.size(); j += 1)
-          for (int k = j+1; k < leaf_placement.size(); k += 1)
-              for (int l = k+1; l < leaf_placement.size(); l += 1) {
-                  double c1, c2, c3;
-                  c1 = dm[i][j] + dm[k][l];
-                  c2 = dm[i][k] + dm[j][l];
-                  c3 = dm[i][l] + dm[j][k];
-
-                  dist_min += std::min( { c1, c2, c3 } ); dist_max += std::max( { c1, c2, c3 } );
-              }
-  // wheee!!
-  //std::cout << "\nQSearchTree::calc_min_max() complete\n";
-  //std::fflush( stdout );
+  if (pool) pool->parallel_for(lps, row_task);
+  else for (int i = 0; i < lps; i += 1) row_task(i);
 
+  std::pair<double, double> bounds(0.0, 0.0);
+  for (auto& r : row_sums) {
+    bounds.first += r.first;
+    bounds.second += r.second;
+  }
+  return bounds;
 }
 
-bool QSearchTree::is_connected(const unsigned int& a, const unsigned int& b) 
+// The bounds depend on the distance matrix alone, so they are computed once and cached on it.
+// Not safe to call concurrently on a matrix without bounds: prime it first (find_better_tree does).
+template<class M> void QSearchTreeT<M>::calc_min_max(QSearchThreadPool* pool) {
+  if (!dm.quartet_bounds) dm.quartet_bounds = quartet_bounds(dm, pool);
+  dist_min = dm.quartet_bounds->first;
+  dist_max = dm.quartet_bounds->second;
+  dist_calculated = true;
+}
+
+template<class M> bool QSearchTreeT<M>::is_connected(const unsigned int& a, const unsigned int& b) 
 {
   // std::cout << "QSearchTree::is_connected() - a = " << a << " b = " << b << "\n";
   assert(a >= 0 && b >= 0 && a < total_node_count && b < total_node_count);
   if (a == b) return false;
-  return a > b ?  n[b].has_neighbor(a) : n[a].has_neighbor(b); // backwards? fixed
+  return n[a].has_neighbor(b);   // connections are stored on both nodes
 }
 
-bool QSearchTree::is_standard_tree()
+template<class M> bool QSearchTreeT<M>::is_standard_tree()
 {
   for (unsigned int i = 0; i < total_node_count; i++) {
     unsigned int nc = get_neighbor_count(i);
@@ -258,49 +186,41 @@ bool QSearchTree::is_standard_tree()
   return true;
 }
 
-unsigned int QSearchTree::get_neighbor_count(const unsigned int& a) {
-  int acc = 0;
+template<class M> unsigned int QSearchTreeT<M>::get_neighbor_count(const unsigned int& a) {
   assert( a < total_node_count );
-  for (unsigned int i = 0; i < total_node_count; i++)
-    if (is_connected(i, a))
-      acc += 1;
-  return acc;
+  return n[a].size();
 }
 
-void QSearchTree::connect(const unsigned int& a, const unsigned int& b)
+template<class M> void QSearchTreeT<M>::connect(const unsigned int& a, const unsigned int& b)
 {
   //std::cout << "QSearchTree::connect() - a = " << a << " b = " << b << "\n";
   assert( a < total_node_count );
   assert( b < total_node_count );
   assert(is_connected(a,b) == false);
   assert(a != b);
-  if (a < b)
-    n[a].add_neighbor(b);
-  else
-    n[b].add_neighbor(a);
+  n[a].add_neighbor(b);
+  n[b].add_neighbor(a);
   must_recalculate_paths = true;
   f_score_good = false;
 }
 
-void QSearchTree::disconnect(const unsigned int& a, const unsigned int& b)
+template<class M> void QSearchTreeT<M>::disconnect(const unsigned int& a, const unsigned int& b)
 {
   assert(is_connected(a,b) == true);
   assert(a != b);
-  if (a < b)
-    n[a].remove_neighbor(b);
-  else
-    n[b].remove_neighbor(a);
+  n[a].remove_neighbor(b);
+  n[b].remove_neighbor(a);
   must_recalculate_paths = true;
   f_score_good = false;
 }
 
 // changed to call by reference
-void QSearchTree::find_path(NodeList& result, unsigned int a, unsigned int b) {
+template<class M> void QSearchTreeT<M>::find_path(NodeList& result, unsigned int a, unsigned int b) {
   find_path_fast(result, a, b);
 }
 
 // changed argument order
-void QSearchTree::find_path_fast(NodeList& result, unsigned int a, unsigned int b)
+template<class M> void QSearchTreeT<M>::find_path_fast(NodeList& result, unsigned int a, unsigned int b)
 {
   result.clear();
   assert(a >= 0 && b >= 0 && a < total_node_count && b < total_node_count);
@@ -323,13 +243,13 @@ void QSearchTree::find_path_fast(NodeList& result, unsigned int a, unsigned int
     std::cout << "Error, broken path from " << a << " to " << b << " for tree.\n";
 }
 
-unsigned int QSearchTree::find_path_length(unsigned int& a, unsigned int& b)
+template<class M> unsigned int QSearchTreeT<M>::find_path_length(unsigned int& a, unsigned int& b)
 {
   find_path_fast(p1, a, b);
   return p1.size();
 }
 
-void QSearchTree::freshen_spm()
+template<class M> void QSearchTreeT<M>::freshen_spm()
 {
   //guint32 target;
   if (!must_recalculate_paths)
@@ -343,16 +263,16 @@ void QSearchTree::freshen_spm()
     
   int i,j;
   for (i=0;i<total_node_count;++i) {  
-      auto& spm_connect = spm[i];
+      unsigned int* spm_connect = spm.row(i);
       for (j=0;j<total_node_count; ++j) {
          if (j==i) continue;
          // path from j to i
-         spm_connect[j] = map[j].connections[ (int) map[j].node_branch[i] ]; 
+         spm_connect[j] = map.next_node(j, i); 
       }
   }
 }
 
-bool QSearchTree::is_consistent_quartet(unsigned int &a, unsigned int &b, unsigned int &c, unsigned int &d)
+template<class M> bool QSearchTreeT<M>::is_consistent_quartet(unsigned int &a, unsigned int &b, unsigned int &c, unsigned int &d)
 {
   //std::cout << "QSearchTree::is_consistent_quartet()\n";
   assert( a < total_node_count );
@@ -376,7 +296,7 @@ bool QSearchTree::is_consistent_quartet(unsigned int &a, unsigned int &b, unsign
   return true;
 }
 
-unsigned int QSearchTree::get_random_node(const node_type& what_kind)
+template<class M> unsigned int QSearchTreeT<M>::get_random_node(const node_type& what_kind)
 {
   unsigned int result;
   unsigned int n;
@@ -392,7 +312,7 @@ unsigned int QSearchTree::get_random_node(const node_type& what_kind)
   return result;
 }
 
-unsigned int QSearchTree::get_random_node_but_not(const node_type& what_kind, const unsigned int& but_not)
+template<class M> unsigned int QSearchTreeT<M>::get_random_node_but_not(const node_type& what_kind, const unsigned int& but_not)
 {
   //std::cout << "QSearchTree::get_random_node_but_not() but_not = " << but_not << "\n";
   unsigned int result;
@@ -403,7 +323,7 @@ unsigned int QSearchTree::get_random_node_but_not(const node_type& what_kind, co
   return result;
 }
 
-unsigned int QSearchTree::get_random_neighbor(const unsigned int& who)
+template<class M> unsigned int QSearchTreeT<M>::get_random_neighbor(const unsigned int& who)
 {
   unsigned int result;
   NodeList neighbors;
@@ -412,13 +332,15 @@ unsigned int QSearchTree::get_random_neighbor(const unsigned int& who)
   return result;
 }
 
-void QSearchTree::get_neighbors(NodeList& neighbors, const unsigned int &who) {
+// neighbours in ascending order
+template<class M> void QSearchTreeT<M>::get_neighbors(NodeList& neighbors, const unsigned int &who) {
   neighbors.clear();
-  for (int i = 0; i < total_node_count; i++) 
-    if (is_connected(i, who)) neighbors.push_back(i);
+  const QSearchNeighborList& lst = n[who];
+  for (int i = 0; i < lst.size(); i++) neighbors.push_back(lst[i]);
+  std::sort(neighbors.begin(), neighbors.end());
 }
 
-bool QSearchTree::is_valid_tree()
+template<class M> bool QSearchTreeT<M>::is_valid_tree()
 {
   unsigned int i, j;
   assert(total_node_count > 3);
@@ -443,7 +365,7 @@ bool QSearchTree::is_valid_tree()
   return true;
 }
 
-void QSearchTree::complex_mutation()
+template<class M> void QSearchTreeT<M>::complex_mutation()
 {
   ms.last_simple_mutations = 0;
   int totmuts = get_mutation_distribution_sample();
@@ -453,7 +375,7 @@ void QSearchTree::complex_mutation()
   ms.total_complex_mutations += 1;
 }
 
-int QSearchTree::get_mutation_distribution_sample()
+template<class M> int QSearchTreeT<M>::get_mutation_distribution_sample()
 {
   const int MAXMUT = 80;
   std::vector<int> p;
@@ -462,12 +384,11 @@ int QSearchTree::get_mutation_distribution_sample()
     double k = i + 4; /* to make single-mutations somewhat less common */
     p.push_back((int)(1000000.0 / (k * (log(k) / log(2.0)) * (log(k)/log(2.0)))));
   }
-  std::default_random_engine generator;
   std::discrete_distribution<> d(p.begin(),p.end());
-  return d(generator)+1;
+  return d(thread_random())+1;
 }
 
-void QSearchTree::simple_mutation()
+template<class M> void QSearchTreeT<M>::simple_mutation()
 {
   bool hm = false;
   int i;
@@ -482,7 +403,7 @@ void QSearchTree::simple_mutation()
   } while (!hm);
 }
 
-void QSearchTree::simple_mutation_leaf_swap()
+template<class M> void QSearchTreeT<M>::simple_mutation_leaf_swap()
 {
   unsigned int l1, l2;
   l1 = get_random_node(NODE_TYPE_LEAF);
@@ -492,7 +413,7 @@ void QSearchTree::simple_mutation_leaf_swap()
   ms.last_simple_mutations += 1;
 }
 
-void QSearchTree::simple_mutation_subtree_transfer()
+template<class M> void QSearchTreeT<M>::simple_mutation_subtree_transfer()
 {
   std::cout << "QSearchTree::simple_mutation_subtree_transfer()\n";
   assert(can_subtree_transfer());
@@ -521,7 +442,7 @@ void QSearchTree::simple_mutation_subtree_transfer()
   ms.last_simple_mutations += 1;
 }
 
-void QSearchTree::simple_mutation_subtree_interchange()
+template<class M> void QSearchTreeT<M>::simple_mutation_subtree_interchange()
 {
   unsigned int k1, k2, n1, n2;
   assert(can_subtree_interchange());
@@ -540,17 +461,17 @@ void QSearchTree::simple_mutation_subtree_interchange()
   ms.last_simple_mutations += 1;
 }
 
-bool QSearchTree::can_subtree_transfer()
+template<class M> bool QSearchTreeT<M>::can_subtree_transfer()
 {
   return (total_node_count >= 9);
 }
 
-bool QSearchTree::can_subtree_interchange()
+template<class M> bool QSearchTreeT<M>::can_subtree_interchange()
 {
   return (total_node_count >= 11);
 }
 
-void QSearchTree::walk_tree(NodeList& result, const unsigned int& fromwhere, bool f_bfs)
+template<class M> void QSearchTreeT<M>::walk_tree(NodeList& result, const unsigned int& fromwhere, bool f_bfs)
 {
   result.clear();
   NodeList todo;
@@ -578,17 +499,17 @@ void QSearchTree::walk_tree(NodeList& result, const unsigned int& fromwhere, boo
   }
 }
 
-  void QSearchTree::walk_tree_bfs(NodeList& result, const unsigned int& fromwhere)
+  template<class M> void QSearchTreeT<M>::walk_tree_bfs(NodeList& result, const unsigned int& fromwhere)
 {
   walk_tree(result, fromwhere, true);
 }
 
-  void QSearchTree::walk_tree_dfs(NodeList& result, const unsigned int& fromwhere)
+  template<class M> void QSearchTreeT<M>::walk_tree_dfs(NodeList& result, const unsigned int& fromwhere)
 {
   walk_tree(result, fromwhere, false);
 }
 
-double QSearchTree::calculate_order_cost()
+template<class M> double QSearchTreeT<M>::calculate_order_cost()
 {
   int i;
   double acc = 0.0;
@@ -606,13 +527,13 @@ double QSearchTree::calculate_order_cost()
     double c;
     unsigned int a = res[i];
     unsigned int b = res[(i+1)%(res.size())];
-    c = dm[a][b] + dm[b][a];
+    c = dm.at(a, b) + dm.at(b, a);
     acc += c;
   }
   return acc;
 }
 
-unsigned int QSearchTree::get_column_number(const unsigned int& nodenum)
+template<class M> unsigned int QSearchTreeT<M>::get_column_number(const unsigned int& nodenum)
 {
   for (unsigned int i = 0; i < leaf_placement.size(); i += 1)
     if (leaf_placement[i] == nodenum)
@@ -621,7 +542,7 @@ unsigned int QSearchTree::get_column_number(const unsigned int& nodenum)
   return 0;
 }
 
-void QSearchTree::mutate_order_simple()
+template<class M> void QSearchTreeT<M>::mutate_order_simple()
 {
   int k = get_random_node(NODE_TYPE_KERNEL);
   nodeflags[k] ^= NODE_FLAG_ISFLIPPED;
@@ -629,7 +550,7 @@ void QSearchTree::mutate_order_simple()
   ms.last_order_simple_mutations += 1;
 }
 
-void QSearchTree::mutate_order_complex()
+template<class M> void QSearchTreeT<M>::mutate_order_complex()
 {
   ms.last_order_simple_mutations = 0;
   do {
@@ -639,13 +560,13 @@ void QSearchTree::mutate_order_complex()
   ms.total_order_complex_mutations += 1;
 }
 
-void QSearchTree::flipped_node_order(NodeList& nodes)  
+template<class M> void QSearchTreeT<M>::flipped_node_order(NodeList& nodes)  
 {
   walk_tree_dfs(nodes, 0);
 }
 
 /* Returns true if every node has exactly 1 or 3 neighbors */
-bool QSearchTree::is_tree_ternary()
+template<class M> bool QSearchTreeT<M>::is_tree_ternary()
 {
   for (int i = 0; i < total_node_count; i++) {
     int nc = get_neighbor_count(i);
@@ -658,7 +579,7 @@ bool QSearchTree::is_tree_ternary()
 /* Sets the "connectedness" state (true or false) between nodes a and b and
  * returns the old connectedness status that was overwritten.
  */
-bool QSearchTree::set_connected(const unsigned int& a, const unsigned int& b, bool newconstate)
+template<class M> bool QSearchTreeT<M>::set_connected(const unsigned int& a, const unsigned int& b, bool newconstate)
 {
   assert(a >= 0 && b >= 0 && a < total_node_count && b < total_node_count);
   if (a == b)
@@ -673,11 +594,11 @@ bool QSearchTree::set_connected(const unsigned int& a, const unsigned int& b, bo
   return oldconstate;
 }
 
-void QSearchTree::clear_all_connections()
+template<class M> void QSearchTreeT<M>::clear_all_connections()
 {
   for (unsigned int i = 0; i < total_node_count; i += 1)
-    for (unsigned int j = i+1; j < total_node_count; j += 1)
-      set_connected(j, i, false);
+    while (n[i].size() > 0)
+      disconnect(i, n[i][0]);
 }
 
 // deferred
@@ -718,14 +639,15 @@ gdouble QSearchTree::read_from_dot(GString *treedot, LabeledMatrix *lm)
 }
 */
 
-double QSearchTree::score_tree()
+// Cached: connect, disconnect and the leaf swap clear f_score_good, so the tree is only
+// rescored after it really changed
+template<class M> double QSearchTreeT<M>::score_tree()
 {
   //std::cout << "\nQSearchTree::score_tree()\n";
   assert(this);
-  if (!dist_calculated) {
-    calc_min_max();
-    dist_calculated = true;
-  }
+  if (f_score_good) return score;
+  QSEARCH_TIME_PHASE(PHASE_SCORE_TREE);
+  if (!dist_calculated) calc_min_max();
    
   double score2 = score_tree_fast_v2();
   
@@ -747,12 +669,9 @@ double QSearchTree::score_tree()
   return score;
 }
 
-double QSearchTree::score_tree_original()
+template<class M> double QSearchTreeT<M>::score_tree_original()
 {
-  if (!dist_calculated) {
-    calc_min_max();
-    dist_calculated = true;
-  }
+  if (!dist_calculated) calc_min_max();
 
 /*
   if (f_score_good) { 
@@ -796,9 +715,9 @@ if(0) // will skip loop
           unsigned int nl = leaf_placement[l];
           bool x1, x2;
           double c1, c2, c3;
-          c1  = dm[i][j] + dm[k][l];
-          c2  = dm[i][k] + dm[j][l];
-          c3  = dm[i][l] + dm[j][k];
+          c1  = dm.at(i, j) + dm.at(k, l);
+          c2  = dm.at(i, k) + dm.at(j, l);
+          c3  = dm.at(i, l) + dm.at(j, k);
           /*minscore = c1; maxscore = c1;
           if (c2 < minscore) minscore = c2;
           if (c3 < minscore) minscore = c3;
@@ -840,20 +759,6 @@ if(0) // will skip loop
    
    double score2 = score_tree_fast_v2();
   //clock_gettime(clockid, &end_time);
-  int inOrder = 0;
-
-  if (inOrder) {  
-      QMatrix<double> dm2(dm.dim);
-      for (i=0; i < dm.dim; ++i) {
-          for (j=0;j<dm.dim;++j) {
-            dm2[leaf_placement[i]][leaf_placement[j]] = dm[i][j];
-          }
-      }
-      QSearchFullTree tree(*this);
-      tree.dm = dm2;
-      printf("Raw scores %f %f\n", score2, tree.raw_score);
-      exit(0);
-  }
         
   //int nanos2 = ((end_time.tv_sec - start_time.tv_sec) * nanos_per_second + end_time.tv_nsec - start_time.tv_nsec);
 
@@ -898,7 +803,7 @@ if(0) // will skip loop
   return score;
 }
 
-double QSearchTree::score_tree_fast_v2() {
+template<class M> double QSearchTreeT<M>::score_tree_fast_v2() {
   //std::cout << "\nQSearchTree::score_tree_fast_v2()\n";
   QSearchConnectedNodeMap map(*this);
   
@@ -932,70 +837,55 @@ double QSearchTree::score_tree_fast_v2() {
     *
     */
   
-  std::vector< std::vector< long long > > tmpmat( node_count, std::vector< long long >(leaf_count * leaf_count, 0ll));
-
-  int node;
-  int branch, n, npairs, first, second, ni, nj;
-{
-#if QSOPENMP_ENABLED
-#pragma omp parallel for shared(tmpmat) schedule(dynamic,CHUNKSIZE) private(branch,n,npairs,first,second,i,ni,j,nj)
-#endif
-    for (node = leaf_count; node < node_count; ++node) {
-        for (branch = 0; branch < 3; ++branch) {
-            n = map[node].leaf_count[branch];
-            
-            if (n > 1) { // we need to accumulate the data for all pairs
-                npairs = n * (n-1) / 2; // number of pairs
-                
-                first = (3 + branch - 1) % 3;
-                second = (branch + 1) % 3;
-                
-//              double sumdistance = 0;
-                 
-                for (i = 0; i < leaf_count; ++i) {
-                    
-                    ni = leaf_placement[i];
-                    if (map[node].node_branch[ni] != first) continue; // this leaf is in the wrong branch
-                    
-                    for (j = 0; j < leaf_count; ++j) {
-                        nj = leaf_placement[j];
-                        if ( map[node].node_branch[nj] != second) continue; // this leaf is in the wrong branch
-                        
-                        if(i!=j) tmpmat[node][i + leaf_count*j] += npairs; 
-                        //double dist  = dm[i][j];
-                        //sumdistance += dist;
-                    }
-                }
-                
-                //sum += npairs * sumdistance;
-            }
-        }
-    }
-}
-    
-    sum = 0.0;
-    for (node = leaf_count; node < node_count; ++node) {
-    for (i = 0; i < leaf_count; ++i) {
-        for (j = 0; j < leaf_count; ++j) {
-            sum += tmpmat[node][i + j*leaf_count] * dm[i][j];
-        }
-    }
+  // Leaf columns are bucketed by the branch of the current node they hang off (a counting sort
+  // into columns, branch_start marks the buckets), so every node costs O(leaf_count) to classify
+  // plus the cross-branch pairs it actually owns. No node_count x leaf_count^2 intermediate.
+  std::vector< unsigned int > columns(leaf_count);
+  int branch_start[4];
+
+  for (int node = leaf_count; node < node_count; ++node) {
+    branch_start[0] = 0;
+    for (int branch = 0; branch < 3; ++branch)
+      branch_start[branch + 1] = branch_start[branch] + map[node].leaf_count[branch];
+    int fill[3] = { branch_start[0], branch_start[1], branch_start[2] };
+    for (i = 0; i < leaf_count; ++i)
+      columns[ fill[ map.node_branch(node, leaf_placement[i]) ]++ ] = i;
+
+    for (int branch = 0; branch < 3; ++branch) {
+      int n = map[node].leaf_count[branch];
+      if (n < 2) continue;
+      double npairs = n * (n-1) / 2; // number of pairs
+
+      int first = (3 + branch - 1) % 3;
+      int second = (branch + 1) % 3;
+
+      double cross = 0.0;
+      for (i = branch_start[first]; i < branch_start[first + 1]; ++i) {
+        const unsigned int ci = columns[i];
+        for (j = branch_start[second]; j < branch_start[second + 1]; ++j)
+          cross += dm.at( ci, columns[j] );
+      }
+      sum += npairs * cross;
     }
+  }
+
   //std::cout << "\nQSearchTree::score_tree_fast_v2() complete\n";
 
   return sum;
 }
 
-std::string QSearchTree::to_dot() {
+template<class M> std::string QSearchTreeT<M>::to_dot() {
   std::ostringstream oss;
   oss << "graph \"" << "untitled" << "\" {\n";
   for (int i = 0; i < total_node_count; i += 1) {
     if( ( i < dm.dim ) && dm.has_labels() ) oss << i << " [label=\"" << dm.labels[i] << "\"];\n";
     else oss << i << " [label=\"node " << i << "\"];\n";
   }
+  NodeList neighbors;
   for (int i = 0; i < total_node_count; i += 1) {
-    for (int j = i; j < total_node_count; j += 1) {
-      if (is_connected(i, j)) {
+    get_neighbors(neighbors, i);
+    for (auto j : neighbors) {
+      if (j > i) {
         oss << i << " -- " << j << " [weight=\"2\"];\n";
       }
     }
@@ -1007,8 +897,9 @@ std::string QSearchTree::to_dot() {
 #include <string>
 #include <sstream>
 
-std::string QSearchTree::to_json() {
+template<class M> std::string QSearchTreeT<M>::to_json() {
   std::ostringstream oss;
+  NodeList neighbors;
   oss << "{\n  \"nodes\": [\n";
 
   for (int i = 0; i < total_node_count; i += 1) {
@@ -1023,14 +914,13 @@ std::string QSearchTree::to_json() {
     // Add connected nodes
     oss << "      \"connections\": [";
     bool first = true;
-    for (int j = 0; j < total_node_count; j += 1) {
-      if (is_connected(i, j)) {
-        if (!first) {
-          oss << ", ";
-        }
-        oss << j;
-        first = false;
+    get_neighbors(neighbors, i);
+    for (auto j : neighbors) {
+      if (!first) {
+        oss << ", ";
       }
+      oss << j;
+      first = false;
     }
     oss << "]\n    }";
 
@@ -1044,3 +934,13 @@ std::string QSearchTree::to_json() {
   oss << "  ]\n}";
   return oss.str();
 }
+
+template std::pair<double, double> quartet_bounds(const QMatrix<double>& dm, QSearchThreadPool* pool);
+template std::pair<double, double> quartet_bounds(const QMatrix<float>& dm, QSearchThreadPool* pool);
+template std::pair<double, double> quartet_bounds(const QSymmetricMatrix<double>& dm, QSearchThreadPool* pool);
+template std::pair<double, double> quartet_bounds(const QSymmetricMatrix<float>& dm, QSearchThreadPool* pool);
+
+template struct QSearchTreeT< QMatrix<double> >;
+template struct QSearchTreeT< QMatrix<float> >;
+template struct QSearchTreeT< QSymmetricMatrix<double> >;
+template struct QSearchTreeT< QSymmetricMatrix<float> >;
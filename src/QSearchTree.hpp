@@ -4,6 +4,7 @@
 #include <vector>
 #include <memory>
 #include "SimpleMatrix.hpp"
+#include "QSymmetricMatrix.hpp"
 #include "QSearchNeighborList.hpp"
 
 #define CHUNKSIZE 1
@@ -45,28 +46,38 @@ typedef enum {
 
 typedef std::vector< unsigned int > NodeList;
 
-struct QSearchTree {
+class QSearchThreadPool;
+struct QSearchRandom;
+
+// M is the distance matrix: a QMatrix, or a QSymmetricMatrix for half the memory. Its values
+// (D) may be float or double; scores, bounds and every sum over distances are kept in double
+// whatever D is. The search reads the matrix through at, upper_row and add_row only.
+template<class M> struct QSearchTreeT {
+  typedef typename M::value_type D;
   int total_node_count;
   bool must_recalculate_paths;
   bool dist_calculated;
-  bool f_score_good;
+  bool f_score_good;      // score is up to date; whatever changes the tree must clear it
   double dist_min;
   double dist_max;
   MutationStatistics ms;
   double score;
-  std::vector< QSearchNeighborList > n;   
+  std::vector< QSearchNeighborList > n;   // symmetric: a connection is listed on both nodes
   NodeList p1, p2;
   QMatrix<unsigned int > spm; 
   std::vector< unsigned int > nodeflags;
-  NodeList leaf_placement;
+  NodeList leaf_placement;    // writing to it directly must clear f_score_good
   // distance matrix
-  QMatrix<double>& dm; // Using reference here as we don't want to be copying this big matrix a lot
+  M& dm; // Using reference here as we don't want to be copying this big matrix a lot
 
-  QSearchTree(QMatrix<double>& dm_init);   
-  QSearchTree(const QSearchTree& q);   
+  QSearchTreeT(M& dm_init);   
+  QSearchTreeT(const QSearchTreeT& q);   
 
-  std::unique_ptr< QSearchTree > find_better_tree(int howManyTries);
-  void calc_min_max();
+  // runs howManyTries independent tries, in parallel when a pool is given. Each try draws from
+  // its own generator split off rng, so results do not depend on the number of threads.
+  std::unique_ptr< QSearchTreeT > find_better_tree(int howManyTries, QSearchRandom& rng, QSearchThreadPool* pool = nullptr);
+  // score normalization bounds, computed once per distance matrix (in parallel when a pool is given)
+  void calc_min_max(QSearchThreadPool* pool = nullptr);
   unsigned int get_leaf_node_count();
   unsigned int get_kernel_node_count();
   QMatrix<unsigned int> get_adjacency_matrix();
@@ -124,4 +135,13 @@ struct QSearchTree {
     //std::string to_nexus_full(QMatrix< unsigned int >& dm); // could be an overload of to_nexus()
 };
 
+// (min, max) sums of quartet topology costs over all quartets of dm; what calc_min_max caches
+// in dm.quartet_bounds
+template<class M> std::pair<double, double> quartet_bounds(const M& dm, QSearchThreadPool* pool = nullptr);
+
+typedef QSearchTreeT< QMatrix<double> > QSearchTree;
+typedef QSearchTreeT< QMatrix<float> >  QSearchTreeFloat;
+typedef QSearchTreeT< QSymmetricMatrix<double> > QSearchTreePacked;
+typedef QSearchTreeT< QSymmetricMatrix<float> >  QSearchTreePackedFloat;
+
 #endif // __QSEARCHTREE_HPP
\ No newline at end of file
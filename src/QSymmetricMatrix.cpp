@@ -0,0 +1,58 @@
+#include "QSymmetricMatrix.hpp"
+#include "QMatrixFile.hpp"
+
+#include <algorithm>
+
+template<class T> static void set_dim(QSymmetricMatrix<T>& sm, const unsigned int& dim)
+{
+    sm.dim = dim;
+    sm.row_start.resize(dim);
+    for (unsigned int i = 0; i < dim; i++) sm.row_start[i] = QMatrixFile::packed_index(i, i + 1, dim);
+    sm.quartet_bounds.reset();
+}
+
+template<class T> void QSymmetricMatrix<T>::assign(const QMatrix<T>& dm)
+{
+    set_dim(*this, dm.dim);
+    labels = dm.labels;
+    owned.resize( size() );
+    T* to = owned.data();
+    for (unsigned int i = 0; i < dim; i++)
+        for (unsigned int j = i + 1; j < dim; j++) *to++ = ( dm.at(i, j) + dm.at(j, i) ) / 2;
+    packed = owned.data();
+}
+
+template<class T> void QSymmetricMatrix<T>::view(const QMatrixFile& mf)
+{
+    set_dim(*this, mf.dim);
+    labels = mf.labels;
+    owned.clear();
+    owned.shrink_to_fit();
+    if (mf.precision == sizeof(T)) {
+        packed = (const T*)mf.values;
+        return;
+    }
+    owned.resize( size() );
+    if (mf.precision == 4) std::copy( (const float*)mf.values, (const float*)mf.values + size(), owned.begin() );
+    else std::copy( (const double*)mf.values, (const double*)mf.values + size(), owned.begin() );
+    packed = owned.data();
+}
+
+template<class T> void QSymmetricMatrix<T>::add_row(double* sum, const unsigned int& i) const
+{
+    for (unsigned int k = 0; k < i; k++) sum[k] += packed[ row_start[k] + (i - k - 1) ];
+    const T* u = upper_row(i);
+    double* s = sum + i + 1;
+    const unsigned int len = dim - i - 1;
+    for (unsigned int t = 0; t < len; t++) s[t] += u[t];
+}
+
+template<class T> void QSymmetricMatrix<T>::gather_row(const unsigned int& i, T* out) const
+{
+    for (unsigned int k = 0; k < i; k++) out[k] = packed[ row_start[k] + (i - k - 1) ];
+    out[i] = 0;
+    std::copy( upper_row(i), upper_row(i) + (dim - i - 1), out + i + 1 );
+}
+
+template struct QSymmetricMatrix<double>;
+template struct QSymmetricMatrix<float>;
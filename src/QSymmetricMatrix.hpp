@@ -0,0 +1,53 @@
+#ifndef __QSYMMETRIC_MATRIX_HPP
+#define __QSYMMETRIC_MATRIX_HPP
+
+#include <vector>
+#include <optional>
+#include <utility>
+#include <cstddef>
+#include "SimpleMatrix.hpp"
+
+struct QMatrixFile;
+
+// Symmetric, zero-diagonal distance matrix keeping only the strict upper triangle, row by row:
+// (0,1) (0,2) .. (0,n-1) (1,2) .. (n-2,n-1), the layout of the matrix file values. Half the
+// memory of a QMatrix. The triangle is either owned or read in place from a mapped QMatrixFile,
+// which must then stay open as long as the matrix is used.
+template<class T> struct QSymmetricMatrix {
+    typedef T value_type;
+
+    std::vector< T, AlignedAllocator<T> > owned;    // empty when viewing a file
+    const T* packed;
+    std::vector< size_t > row_start;    // position of (i, i+1)
+    StringList labels;
+    unsigned int dim;
+    // as on QMatrix: filled in by QSearchTree::calc_min_max, cleared when the values change
+    std::optional< std::pair<double, double> > quartet_bounds;
+
+    QSymmetricMatrix() : owned(), packed(nullptr), row_start(), labels(), dim(0), quartet_bounds() {}
+    explicit QSymmetricMatrix(const QMatrix<T>& dm) : QSymmetricMatrix() { assign(dm); }
+    QSymmetricMatrix(const QSymmetricMatrix&) = delete;
+    QSymmetricMatrix& operator =(const QSymmetricMatrix&) = delete;
+
+    // copies dm, averaging across the diagonal like make_symmetric
+    void assign(const QMatrix<T>& dm);
+    // reads the file's triangle in place when it has the precision of T, copies it otherwise
+    void view(const QMatrixFile& mf);
+    bool is_view() const { return packed != nullptr && owned.empty(); }
+
+    T at(const unsigned int& i, const unsigned int& j) const {
+        if (i == j) return 0;
+        return i < j ? packed[ row_start[i] + (j - i - 1) ] : packed[ row_start[j] + (i - j - 1) ];
+    }
+    // (i, i+1+t) at [t], contiguous
+    const T* upper_row(const unsigned int& i) const { return packed + row_start[i]; }
+    // sum[k] += d(i,k) for every k: the part left of the diagonal is gathered down column i
+    void add_row(double* sum, const unsigned int& i) const;
+    // row i written out in full, zero on the diagonal
+    void gather_row(const unsigned int& i, T* out) const;
+
+    bool has_labels() const { return labels.size() != 0; }
+    size_t size() const { return (size_t)dim * (dim ? dim - 1 : 0) / 2; }   // values stored
+};
+
+#endif // __QSYMMETRIC_MATRIX_HPP
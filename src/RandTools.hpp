@@ -1,18 +1,115 @@
 #ifndef __RAND_TOOLS_HPP
 #define __RAND_TOOLS_HPP
 #include <random>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
 
-static std::random_device rd;    // non-deterministic generator
-static std::mt19937 gen( rd() ); // start random engine
-static std::uniform_real_distribution<float> rand1( 0.0f, 1.0f );
-static std::uniform_int_distribution<unsigned int> random_bit( 0, 1 ); 
-static float rand_range(const float a, const float b) { return a + ( b - a ) * rand1( gen ); }
+// xoshiro256** generator (Blackman & Vigna). Small, fast and good enough for the search;
+// every search (or thread) owns one, so no state is shared between threads.
+// Also usable as a UniformRandomBitGenerator with the <random> distributions.
+struct QSearchRandom {
+    typedef uint64_t result_type;
+    uint64_t s[4];
+
+    explicit QSearchRandom(uint64_t seed_init = 0) { seed( seed_init ); }
+
+    // expand a 64 bit seed with splitmix64, which never yields an all-zero state
+    void seed(uint64_t x) {
+        for (auto& w : s) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            w = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0]; s[3] ^= s[1]; s[1] ^= s[2]; s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits< uint64_t >::max(); }
+    result_type operator ()() { return next(); }
+
+    // new generator with its own stream, e.g. one per try handed out before going parallel
+    QSearchRandom split() { return QSearchRandom( next() ); }
+
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }    // [0,1)
+    // [0,bound) without division (Lemire's multiply-shift; bias is below 2^-32)
+    uint32_t below(uint32_t bound) { return (uint32_t)( ( (next() >> 32) * (uint64_t)bound ) >> 32 ); }
+    // inclusive range - take care!
+    int rand_int(const int a, const int b) { return a + (int)below( (uint32_t)(b - a) + 1 ); }
+    unsigned int rand_int(const unsigned int a, const unsigned int b) { return a + below( b - a + 1 ); }
+    float rand_range(const float a, const float b) { return a + ( b - a ) * (float)uniform(); }
+    bool fair_coin() { return ( next() >> 63 ) == 1; }
+    // potentially unfair coin - returns 1 with probability a
+    unsigned int weighted_bit(const float a) { return uniform() < a ? 1 : 0; }
+
+    // bulk sampling: count values in [0,bound), two per call to next()
+    void fill_below(uint32_t* out, size_t count, uint32_t bound) {
+        size_t i = 0;
+        for (; i + 1 < count; i += 2) {
+            uint64_t r = next();
+            out[i]     = (uint32_t)( ( (r >> 32) * (uint64_t)bound ) >> 32 );
+            out[i + 1] = (uint32_t)( ( (r & 0xffffffffull) * (uint64_t)bound ) >> 32 );
+        }
+        if (i < count) out[i] = below( bound );
+    }
+
+    // bulk sampling: count pairs a[i] != b[i] in [0,bound), bound >= 2
+    void fill_pairs(uint32_t* a, uint32_t* b, size_t count, uint32_t bound) {
+        for (size_t i = 0; i < count; i++) {
+            uint64_t r = next();
+            a[i] = (uint32_t)( ( (r >> 32) * (uint64_t)bound ) >> 32 );
+            // draw from the bound-1 other values so no retry is needed
+            uint32_t o = (uint32_t)( ( (r & 0xffffffffull) * (uint64_t)(bound - 1) ) >> 32 );
+            b[i] = o >= a[i] ? o + 1 : o;
+        }
+    }
+
+    private:
+    static uint64_t rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+// Seed from the non-deterministic generator, for searches that were not given one
+inline uint64_t random_seed()
+{
+    std::random_device rd;
+    return ( (uint64_t)rd() << 32 ) ^ rd();
+}
+
+// Engine used by code that is not handed one explicitly (tree mutations and the helpers below).
+// Each thread has its own default engine; QSearchRandomScope rebinds it for the calling thread,
+// so a search can make these calls draw from its own seeded generator.
+inline thread_local QSearchRandom* qsearch_bound_random = nullptr;
+
+inline QSearchRandom& thread_random()
+{
+    static thread_local QSearchRandom own( random_seed() );
+    return qsearch_bound_random ? *qsearch_bound_random : own;
+}
+
+struct QSearchRandomScope {
+    QSearchRandom* saved;
+    explicit QSearchRandomScope(QSearchRandom& r) : saved( qsearch_bound_random ) { qsearch_bound_random = &r; }
+    ~QSearchRandomScope() { qsearch_bound_random = saved; }
+    QSearchRandomScope(const QSearchRandomScope&) = delete;
+    QSearchRandomScope& operator =(const QSearchRandomScope&) = delete;
+};
+
+inline float rand_range(const float a, const float b) { return thread_random().rand_range( a, b ); }
 // inclusive range - take care!
-static int rand_int(const int a, const int b) { std::uniform_int_distribution<int> r(a,b); return r(gen); }
-static unsigned int rand_int(const unsigned int a, const unsigned int b) { std::uniform_int_distribution<unsigned int> r(a,b); return r(gen); }
-static bool fair_coin() { return ( random_bit(gen) == 1 ); }
+inline int rand_int(const int a, const int b) { return thread_random().rand_int( a, b ); }
+inline unsigned int rand_int(const unsigned int a, const unsigned int b) { return thread_random().rand_int( a, b ); }
+inline bool fair_coin() { return thread_random().fair_coin(); }
 
 // potentially unfair coin - returns 1 with probability a
-static unsigned int weighted_bit( const float a ) { if( rand1( gen ) < a ) return 1; else return 0; }
+inline unsigned int weighted_bit( const float a ) { return thread_random().weighted_bit( a ); }
 
-#endif // __RAND_TOOLS_HPP
\ No newline at end of file
+#endif // __RAND_TOOLS_HPP
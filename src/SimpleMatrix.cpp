@@ -1,15 +1,32 @@
 #include <iostream>
-#include <cassert>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <atomic>
+#include <memory>
+#include <unordered_set>
 #include "SimpleMatrix.hpp"
+#include "QSearchThreadPool.hpp"
 
-template<class T> inline void QMatrix<T>::resize(const unsigned int &dim)
-{ m.resize(dim); for(auto v : m) v.resize(dim); }
-
-template<class T> inline std::vector<T> QMatrix<T>::operator[](const unsigned int &i) const
-{ assert(i<m.size()); return m[i]; }
+template<class T> unsigned int QMatrix<T>::padded_stride(const unsigned int &dim)
+{
+    const std::size_t per_line = ROW_ALIGN / sizeof(T);
+    return (unsigned int)( ( dim + per_line - 1 ) / per_line * per_line );
+}
 
-template<class T> inline std::vector<T> &QMatrix<T>::operator[](const unsigned int &i)
-{ assert(i<m.size()); return m[i]; }
+template<class T> void QMatrix<T>::resize(const unsigned int &new_dim)
+{
+    const unsigned int new_stride = padded_stride(new_dim);
+    std::vector< T, AlignedAllocator<T, ROW_ALIGN> > grown( (std::size_t)new_dim * new_stride, T() );
+    const unsigned int keep = std::min(dim, new_dim);
+    for (unsigned int i = 0; i < keep; i++)
+        std::copy( row(i), row(i) + keep, grown.data() + (std::size_t)i * new_stride );
+    m.swap(grown);
+    dim = new_dim;
+    stride = new_stride;
+    quartet_bounds.reset();
+}
 
 template<class T> bool QMatrix<T>::has_labels()
 { return ( labels.size() != 0 );  }
@@ -17,70 +34,147 @@ template<class T> bool QMatrix<T>::has_labels()
 template<class T> void QMatrix<T>::to_string(std::string& s) 
 {
     s.clear();
-    if( has_labels() ) {
-        auto label_it = labels.begin();
-        for( auto v : m ) {
-            s += *label_it;
-            for( auto a : v ) { 
-                s += " "; 
-                s += std::to_string(a);
-            }
-            s +=  "\n";
-            label_it++;
-        }
-    }
-    else {
-        for( auto v : m ) {
-            for( auto a : v ) {
-                s += " ";
-                s += std::to_string(a);
-            }
-            s +=  "\n";
+    for( unsigned int i = 0; i < dim; i++ ) {
+        if( has_labels() ) s += labels[i];
+        for( auto a : (*this)[i] ) {
+            s += " ";
+            s += std::to_string(a);
         }
+        s +=  "\n";
     }
 }
 
-template<class T> void QMatrix<T>::from_string( const std::string& s ) 
+// fields are separated by spaces or tabs; '\r' too, so Windows line ends need no special case
+static bool is_blank(const char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+template<class T> bool QMatrix<T>::from_string( const std::string& s, QSearchThreadPool* pool, unsigned int* asymmetric_pairs )
 {
-    m.clear();
-    labels.clear();
-    StringList rows;
-    // std::cout << "Reading rows\n";
-    segment_string( rows, s, '\n' );   // break string into rows
+    // rows are views of the lines with anything but blanks on them
+    std::vector< std::string_view > rows;
+    for( const char* p = s.data(), *end = p + s.size(); p < end; ) {
+        const char* nl = (const char*)memchr( p, '\n', end - p );
+        if( !nl ) nl = end;
+        const char* q = p;
+        while( q < nl && is_blank(*q) ) q++;
+        if( q < nl ) rows.emplace_back( p, nl - p );
+        p = nl + 1;
+    }
 
-    print_string_list( rows, "\n" );
+    labels.clear();
+    dim = 0;
+    resize( rows.size() );
+    const unsigned int n = dim;
+    std::vector< std::string_view > row_labels(n);
 
-    dim = rows.size();
-    // std::cout << "matrix size " << dim << "\n";
-    m.resize( dim );
-    auto row_it = m.begin();
-    // std::cout << "\nReading values from each row\n";
-    for( auto& row_str : rows ) {
-        StringList values;
-        //row_str += " "; // add a space, just cuz
-        segment_string( values, row_str, ' ' );
-        if( values.size() == dim + 1 ) {    // has label
-            labels.push_back( values[0] );
-            values.erase( values.begin() );
+    // blocks of rows are parsed in parallel; each keeps its first problem and the one of the
+    // earliest row is reported
+    const unsigned int BLOCK = 16;
+    const unsigned int blocks = ( n + BLOCK - 1 ) / BLOCK;
+    std::vector< std::string > problems(blocks);
+    // pairs across the diagonal are compared as soon as both their blocks are parsed, by the
+    // block that comes second; one arrival count per pair of blocks
+    std::vector< unsigned int > counts(blocks, 0);
+    std::unique_ptr< std::atomic< unsigned char >[] > arrived;
+    if( asymmetric_pairs ) {
+        arrived.reset( new std::atomic< unsigned char >[ (std::size_t)blocks * ( blocks + 1 ) / 2 ] );
+        for( std::size_t k = 0; k < (std::size_t)blocks * ( blocks + 1 ) / 2; k++ ) arrived[k] = 0;
+    }
+    // pairs (i, j <= i) with i in block hi and j in block lo that differ, or non-zero diagonal entries
+    auto count_asymmetric = [&](unsigned int hi, unsigned int lo) {
+        unsigned int count = 0;
+        for( unsigned int i = hi * BLOCK; i < std::min( n, ( hi + 1 ) * BLOCK ); i++ ) {
+            if( hi == lo ) count += at(i, i) != 0;
+            for( unsigned int j = lo * BLOCK; j < std::min( i, ( lo + 1 ) * BLOCK ); j++ ) count += at(i, j) != at(j, i);
+        }
+        return count;
+    };
+    auto parse_block = [&](unsigned int b) {
+        std::vector< double > values;
+        values.reserve( n + 1 );
+        for( unsigned int i = b * BLOCK; i < std::min( n, ( b + 1 ) * BLOCK ); i++ ) {
+            values.clear();
+            unsigned int fields = 0;    // numbers on the row; only the first n + 1 are kept
+            std::string_view first;
+            bool first_is_number = true;
+            const char* c = rows[i].data(), *e = c + rows[i].size();
+            for(;;) {
+                while( c < e && is_blank(*c) ) c++;
+                if( c == e ) break;
+                const char* token = c;
+                while( c < e && !is_blank(*c) ) c++;
+                if( first.empty() ) first = std::string_view( token, c - token );
+                double v;
+                // from_chars takes no '+', stod did: skip one, but not in front of another sign
+                const char* digits = token + ( *token == '+' && c - token > 1 && token[1] != '-' && token[1] != '+' );
+                auto parsed = std::from_chars( digits, c, v );
+                if( parsed.ec != std::errc() || parsed.ptr != c ) {
+                    if( token == first.data() ) { first_is_number = false; continue; }
+                    problems[b] = "row " + std::to_string(i + 1) + ": " + std::string( token, c - token ) + " is not a number";
+                    return;
+                }
+                if( fields++ <= n ) values.push_back(v);
+            }
+            // a first field is the label when there is one field more than there are rows,
+            // so numeric labels work too
+            unsigned int skip = 0;
+            if( !first_is_number || fields == n + 1 ) {
+                row_labels[i] = first;
+                skip = first_is_number ? 1 : 0;
+            }
+            if( fields - skip != n ) {
+                problems[b] = "row " + std::to_string(i + 1) + " has " + std::to_string(fields - skip)
+                    + " values, the matrix has " + std::to_string(n) + " rows";
+                return;
+            }
+            T* r = row(i);
+            for( unsigned int j = 0; j < n; j++ ) r[j] = (T)values[skip + j];
         }
+        if( !asymmetric_pairs ) return;
+        for( unsigned int a = 0; a < blocks; a++ ) {
+            unsigned int hi = std::max(a, b), lo = std::min(a, b);
+            if( a != b && arrived[ (std::size_t)hi * ( hi + 1 ) / 2 + lo ].fetch_add(1) == 0 ) continue;
+            counts[b] += count_asymmetric(hi, lo);
+        }
+    };
+    if( pool ) pool->parallel_for( blocks, parse_block );
+    else for( unsigned int b = 0; b < blocks; b++ ) parse_block(b);
 
-        //print_string_list( values, " " );
-        // std::cout << "\n";
+    std::string problem;
+    for( auto& p : problems ) if( !p.empty() ) { problem = p; break; }
+    if( problem.empty() ) {
+        unsigned int labelled = std::count_if( row_labels.begin(), row_labels.end(), [](std::string_view l) { return !l.empty(); } );
+        if( labelled != 0 && labelled != n ) {
+            unsigned int i = std::find( row_labels.begin(), row_labels.end(), std::string_view() ) - row_labels.begin();
+            problem = "row " + std::to_string(i + 1) + " has no label, other rows do";
+        }
+        else if( labelled ) {
+            std::unordered_set< std::string_view > seen;
+            for( unsigned int i = 0; i < n && problem.empty(); i++ )
+                if( !seen.insert( row_labels[i] ).second ) problem = "row " + std::to_string(i + 1) + " repeats the label " + std::string( row_labels[i] );
+        }
+    }
+    if( !problem.empty() ) {
+        std::cerr << "matrix " << problem << "\n";
+        resize(0);
+        return false;
+    }
+    if( row_labels.size() && !row_labels[0].empty() )
+        for( auto& l : row_labels ) labels.emplace_back(l);
 
-        assert( values.size() == dim );
-        for( auto& value : values) row_it->push_back( (T)std::stod( value ) );
-        row_it++;
+    if( asymmetric_pairs ) {
+        *asymmetric_pairs = 0;
+        for( auto c : counts ) *asymmetric_pairs += c;
     }
-    assert( ( labels.size() == 0 ) || ( labels.size() == dim ) );
+    return true;
 }
 
 template<class T> bool QMatrix<T>::is_symmetric() {
     bool result = true;
     for(int i=0; i< dim; i++ ) {
         for(int j=0; j< dim; j++ ) {
-            if( m[i][j] != m[j][i] ) {
+            if( at(i,j) != at(j,i) ) {
                 result = false;
-                std::cout << "matrix asymmetry " << i << " " << j << " " << m[i][j] << " " << m[j][i] << "\n";
+                std::cout << "matrix asymmetry " << i << " " << j << " " << at(i,j) << " " << at(j,i) << "\n";
             }
         }
     }
@@ -89,17 +183,19 @@ template<class T> bool QMatrix<T>::is_symmetric() {
 
 // assure that matrix is symmetric and zero-diagonal
 template<class T> void QMatrix<T>::make_symmetric() {
+quartet_bounds.reset();
 for(int i=0; i< dim; i++ ) {
     for(int j=0; j< dim; j++ ) {
-        if( i == j ) { m[i][j] = 0; }
+        if( i == j ) { at(i,j) = 0; }
         else {
-            T avg = (m[i][j] + m[j][i]) / 2;    // use the average of differing values across the diagonal
-            m[i][j] = avg;
-            m[j][i] = avg;
+            T avg = (at(i,j) + at(j,i)) / 2;    // use the average of differing values across the diagonal
+            at(i,j) = avg;
+            at(j,i) = avg;
         }
         }
     }
 }
 
 template class QMatrix<unsigned int>;
-template class QMatrix<double>;
\ No newline at end of file
+template class QMatrix<double>;
+template class QMatrix<float>;
@@ -3,31 +3,81 @@
 
 #include <vector>
 #include <optional>
+#include <utility>
 #include <iostream>
+#include <span>
+#include <new>
+#include <cstddef>
 #include "StringTools.hpp"
 
 void segment_string( StringList& v, const std::string& s, const unsigned char c );
 
+class QSearchThreadPool;
+
+// Allocator handing out blocks aligned to Align bytes (a cache line by default)
+template<class T, std::size_t Align = 64> struct AlignedAllocator {
+    typedef T value_type;
+    template<class U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() noexcept {}
+    template<class U> AlignedAllocator(const AlignedAllocator<U, Align>&) noexcept {}
+
+    T* allocate(std::size_t n) { return static_cast<T*>( ::operator new( n * sizeof(T), std::align_val_t(Align) ) ); }
+    void deallocate(T* p, std::size_t) noexcept { ::operator delete( p, std::align_val_t(Align) ); }
+
+    template<class U> bool operator ==(const AlignedAllocator<U, Align>&) const noexcept { return true; }
+    template<class U> bool operator !=(const AlignedAllocator<U, Align>&) const noexcept { return false; }
+};
+
 // Minimal matrix class supports only storage and retrieval of data
 // No matrix math, but it could be extended to include this
+// Values live in one row-major buffer. Every row starts on a cache line and is padded
+// with zeroes up to stride elements, so rows can be read whole by vectorized loops.
 template<class T> struct QMatrix {
-    std::vector< std::vector<T> > m;
+    typedef T value_type;
+    static const std::size_t ROW_ALIGN = 64;   // bytes
+
+    std::vector< T, AlignedAllocator<T, ROW_ALIGN> > m;
     StringList labels;
     unsigned int dim;   // matrix constrained to be square
+    unsigned int stride;    // elements per row, including padding
+    // (min, max) quartet cost sums that normalize tree scores; filled in by QSearchTree::calc_min_max.
+    // resize and make_symmetric clear it, code writing values through at() or row() must reset it.
+    std::optional< std::pair<double, double> > quartet_bounds;
+
+    QMatrix() : m(), labels(), dim(0), stride(0), quartet_bounds() {}
+    QMatrix(const unsigned int& dim_init )
+        : m(), labels(), dim(0), stride(0), quartet_bounds() { resize(dim_init); }
+    QMatrix(const unsigned int& dim_init, const StringList& labels_init)
+        : m(), labels(labels_init), dim(0), stride(0), quartet_bounds() { resize(dim_init); }
+
+    // row views, no copying
+    std::span<const T> operator [](const unsigned int& i) const { return std::span<const T>( row(i), dim ); }
+    std::span<T>       operator [](const unsigned int& i)       { return std::span<T>( row(i), dim ); }
 
-    QMatrix() : dim(0), labels(), m() {}
-    QMatrix(const unsigned int& dim_init ) 
-        : dim(dim_init), labels(), m(dim_init, std::vector<T>(dim_init)) {}
-    QMatrix(const unsigned int& dim_init, const StringList& labels_init) 
-        : dim(dim_init), labels(labels_init), m(dim_init, std::vector<T>(dim_init)) {}
+    // unchecked element and row access for the hot loops
+    const T& at(const unsigned int& i, const unsigned int& j) const { return m[ (std::size_t)i * stride + j ]; }
+    T&       at(const unsigned int& i, const unsigned int& j)       { return m[ (std::size_t)i * stride + j ]; }
+    const T* row(const unsigned int& i) const { return m.data() + (std::size_t)i * stride; }
+    T*       row(const unsigned int& i)       { return m.data() + (std::size_t)i * stride; }
+    // the search reads matrices through these, as QSymmetricMatrix has no whole rows to hand out:
+    // (i, i+1+t) at [t], and sum[k] += at(i,k) for every k
+    const T* upper_row(const unsigned int& i) const { return row(i) + i + 1; }
+    void add_row(double* sum, const unsigned int& i) const {
+        const T* r = row(i);
+        for (unsigned int k = 0; k < dim; k++) sum[k] += r[k];
+    }
 
-    std::vector<T>  operator [](const unsigned int& i) const; 
-    std::vector<T>& operator [](const unsigned int& i);
+    static unsigned int padded_stride(const unsigned int& dim);
 
     bool has_labels();
     void to_string(std::string& s);
-    void from_string( const std::string& s );
-    void resize(const unsigned int& new_dim);
+    // Parses rows of whitespace separated values, each optionally led by a label. Blocks of rows
+    // go to the pool if there is one. Bad shapes, numbers or labels are reported on stderr and
+    // leave an empty matrix. asymmetric_pairs, if given, receives the number of pairs differing
+    // across the diagonal plus non-zero diagonal entries.
+    bool from_string( const std::string& s, QSearchThreadPool* pool = nullptr, unsigned int* asymmetric_pairs = nullptr );
+    void resize(const unsigned int& new_dim);   // keeps the overlapping values
     bool is_symmetric();
     void make_symmetric();  // assure that matrix is symmetric and zero-diagonal
 };
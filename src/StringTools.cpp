@@ -24,6 +24,10 @@ bool read_whole_file( std::string& s, const std::string& filename )
 {
     try {
         std::ifstream ifs(filename, std::ios_base::binary);
+        if (!ifs) {
+            std::cerr << "cannot read " << filename << "\n";
+            return false;
+        }
         std::ostringstream sstr;
         sstr << ifs.rdbuf();
         s = sstr.str();
@@ -13,6 +13,7 @@ std::string remove_extension(const std::string& filename);
 // Breaks a string up into a vector of substrings wherever separated by a given character
 void segment_string( StringList& v, const std::string& s, const char c );
 void print_string_list( const StringList& v, const std::string spacer );
+// false, saying so on stderr, when the file cannot be opened
 bool read_whole_file( std::string& s, const std::string& filename );
 bool write_whole_file( const std::string& s, const std::string& filename );
 
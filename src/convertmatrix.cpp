@@ -0,0 +1,56 @@
+#include "QMatrixFile.hpp"
+
+#include <cstring>
+#include <cstdlib>
+
+// Converts distance matrices between the text format and the binary one maketree maps directly
+
+static void print_help_and_exit()
+{
+  std::cout << "Usage:\n\n";
+  std::cout << "convertmatrix [-f] [-t] <input> <output>\n";
+  std::cout << "          input is a text or binary matrix, told apart by its content\n";
+  std::cout << "          -f  store single precision values, half the size (default double)\n";
+  std::cout << "          -t  write a text matrix instead of a binary one\n";
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int precision = 8;
+  bool text = false;
+  StringList filenames;
+
+  if (argc < 3) print_help_and_exit();
+  for (char **cur = argv+1; *cur; cur += 1) {
+    if (strcmp(*cur, "-f") == 0) {
+      precision = 4;
+      continue;
+    }
+    if (strcmp(*cur, "-t") == 0) {
+      text = true;
+      continue;
+    }
+    filenames.push_back(*cur);
+  }
+  if (filenames.size() != 2) print_help_and_exit();
+
+  QMatrix<double> dm;
+  if (QMatrixFile::is_matrix_file(filenames[0])) {
+    QMatrixFile mf;
+    if (!mf.open(filenames[0])) return 1;
+    mf.to_matrix(dm);
+  }
+  else {
+    std::string s;
+    if (!read_whole_file(s, filenames[0])) return 1;
+    if (!dm.from_string(s)) return 1;
+  }
+
+  if (text) {
+    std::string s;
+    dm.to_string(s);
+    return write_whole_file(s, filenames[1]) ? 0 : 1;
+  }
+  return QMatrixFile::write(dm, filenames[1], precision) ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#include "QSearchNcd.hpp"
+#include "QSearchThreadPool.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+// Computes an NCD distance matrix for maketree from files or FASTA records
+
+static void print_help_and_exit()
+{
+  std::cout << "Usage:\n\n";
+  std::cout << "ncd [-c compressor] [-t threads] [-f] [-C cachefile] [-a matrixfile] [-o matrixfile] <file>...\n";
+  std::cout << "          -c  compressor (default gzip), see -l\n";
+  std::cout << "          -l  list the compressors built in\n";
+  std::cout << "          -t  number of threads (default: one per core)\n";
+  std::cout << "          -f  objects are the records of FASTA files, not whole files\n";
+  std::cout << "          -C  keep compressed sizes in a cache file and reuse them\n";
+  std::cout << "          -a  add the objects missing from an existing matrix to it;\n";
+  std::cout << "              only pairs with a new object are compressed\n";
+  std::cout << "          -o  write the matrix to a file instead of standard output\n";
+  exit(0);
+}
+
+int main(int argc, char **argv)
+{
+  std::string compressor_name = "gzip";
+  std::string output_filename;
+  std::string cache_filename;
+  std::string matrix_filename;
+  unsigned int thread_count = 0;
+  bool fasta = false;
+  StringList filenames;
+
+  if (argc < 2) print_help_and_exit();
+  for (char **cur = argv+1; *cur; cur += 1) {
+    if (strcmp(*cur, "-c") == 0 || strcmp(*cur, "-t") == 0 || strcmp(*cur, "-o") == 0
+        || strcmp(*cur, "-C") == 0 || strcmp(*cur, "-a") == 0) {
+      if (cur[1] == NULL) {
+        std::cout << *cur << " requires an argument\n";
+        print_help_and_exit();
+      }
+      if ((*cur)[1] == 'c') compressor_name = cur[1];
+      else if ((*cur)[1] == 't') thread_count = atoi(cur[1]);
+      else if ((*cur)[1] == 'C') cache_filename = cur[1];
+      else if ((*cur)[1] == 'a') matrix_filename = cur[1];
+      else output_filename = cur[1];
+      cur += 1;
+      continue;
+    }
+    if (strcmp(*cur, "-l") == 0) {
+      print_string_list( QSearchCompressor::available(), "\n" );
+      return 0;
+    }
+    if (strcmp(*cur, "-f") == 0) {
+      fasta = true;
+      continue;
+    }
+    filenames.push_back(*cur);
+  }
+  if (filenames.empty()) print_help_and_exit();
+
+  std::unique_ptr< QSearchCompressor > compressor = QSearchCompressor::create(compressor_name);
+  if (!compressor) {
+    std::cerr << "Compressor not available: " << compressor_name << "\n";
+    return 1;
+  }
+
+  std::vector< NcdObject > objects;
+  bool read_ok = true;
+  if (fasta) for (auto& f : filenames) read_ok = read_fasta(objects, f) && read_ok;
+  else read_ok = read_ncd_files(objects, filenames);
+  if (!read_ok || objects.size() < 2) {
+    std::cerr << "Need at least two readable objects\n";
+    return 1;
+  }
+
+  QMatrix<double> dm;
+  if (!matrix_filename.empty()) {
+    std::string s;
+    if (!read_whole_file(s, matrix_filename)) return 1;
+    if (!dm.from_string(s)) return 1;
+    // the matrix's objects go first, in its order, then the new ones in the order given
+    std::vector< NcdObject > ordered;
+    for (auto& label : dm.labels) {
+      auto found = std::find_if(objects.begin(), objects.end(), [&](const NcdObject& o) { return o.label == label; });
+      if (found == objects.end()) {
+        std::cerr << "No object for " << label << " in " << matrix_filename << "\n";
+        return 1;
+      }
+      ordered.push_back( std::move(*found) );
+      objects.erase(found);
+    }
+    for (auto& o : objects) ordered.push_back( std::move(o) );
+    objects.swap(ordered);
+  }
+
+  std::unique_ptr< QSearchNcdCache > cache;
+  if (!cache_filename.empty()) cache.reset( new QSearchNcdCache(cache_filename) );
+  QSearchThreadPool pool(thread_count);
+  QSearchNcd ncd(*compressor, &pool, cache.get());
+  if (!ncd.extend(dm, objects)) {
+    std::cerr << "Matrix " << matrix_filename << " has no labels\n";
+    return 1;
+  }
+
+  std::string s;
+  dm.to_string(s);
+  if (output_filename.empty()) std::cout << s;
+  else if (!write_whole_file(s, output_filename)) return 1;
+  return 0;
+}
@@ -0,0 +1,318 @@
+#include "QSearchFullTree.hpp"
+#include "QSearchConnectedNode.hpp"
+#include "QSearchManager.hpp"
+#include "RandTools.hpp"
+#include "QSearchThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <new>
+#include <sys/resource.h>
+
+// Benchmarks of the hot kernels and of whole searches on synthetic matrices of a chosen size and
+// structure: time and heap allocations per operation, and the peak resident set size. Prints one
+// JSON document, so runs can be kept and compared between builds and machines.
+
+static std::atomic< unsigned long long > allocation_count(0);
+
+// every form the library allocates through: AlignedAllocator, and so every QMatrix buffer, uses
+// the align_val_t ones
+void* operator new(std::size_t n)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t n, std::align_val_t al)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    const std::size_t a = (std::size_t)al;
+    const std::size_t size = n ? (n + a - 1) / a * a : a;   // aligned_alloc wants a multiple of a
+    if (void* p = std::aligned_alloc(a, size)) return p;
+    throw std::bad_alloc();
+}
+void* operator new[](std::size_t n) { return operator new(n); }
+void* operator new[](std::size_t n, std::align_val_t al) { return operator new(n, al); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+// symmetric zero-diagonal matrix of uniform random distances: no tree fits it well
+static void random_matrix(QMatrix<double>& dm, unsigned int dim, QSearchRandom& rng)
+{
+    dm.resize(dim);
+    for (unsigned int i = 0; i < dim; i++)
+        for (unsigned int j = i + 1; j < dim; j++)
+            dm.at(i, j) = dm.at(j, i) = 0.5 + 0.5 * rng.uniform();
+}
+
+// Distances along a random rooted binary tree, grown by hanging two clusters under a new node
+// until one is left. Ultrametric trees put every new node at one height above all leaves below
+// it; the others get random branch lengths. Noise then multiplies every distance by a uniform
+// factor in [1 - noise, 1 + noise].
+static void tree_matrix(QMatrix<double>& dm, unsigned int dim, QSearchRandom& rng, bool ultrametric, double noise)
+{
+    dm.resize(dim);
+    std::vector< std::vector< unsigned int > > clusters(dim);
+    std::vector< double > height(dim, 0.0);     // of each cluster's top node
+    std::vector< double > up(dim, 0.0);         // from each leaf to the top of its cluster
+    for (unsigned int i = 0; i < dim; i++) clusters[i].push_back(i);
+    double top = 0.0;
+    while (clusters.size() > 1) {
+        unsigned int a = rng.below( clusters.size() ), b = rng.below( clusters.size() - 1 );
+        if (b >= a) b++;
+        double la = 0.1 + rng.uniform(), lb = 0.1 + rng.uniform();
+        if (ultrametric) {
+            top = std::max( height[a], height[b] ) + 0.1 + rng.uniform();
+            la = top - height[a];
+            lb = top - height[b];
+        }
+        for (auto i : clusters[a])
+            for (auto j : clusters[b]) dm.at(i, j) = dm.at(j, i) = up[i] + la + up[j] + lb;
+        for (auto i : clusters[a]) up[i] += la;
+        for (auto j : clusters[b]) up[j] += lb;
+        clusters[a].insert( clusters[a].end(), clusters[b].begin(), clusters[b].end() );
+        height[a] = ultrametric ? top : 0.0;
+        clusters[b].swap( clusters.back() );
+        height[b] = height[ clusters.size() - 1 ];
+        clusters.pop_back();
+    }
+    for (unsigned int i = 0; i < dim; i++)
+        for (unsigned int j = i + 1; j < dim; j++)
+            dm.at(i, j) = dm.at(j, i) = dm.at(i, j) * ( 1.0 + noise * ( 2.0 * rng.uniform() - 1.0 ) );
+}
+
+static const char* const MATRIX_KINDS[] = { "random", "ultrametric", "noisy_tree" };
+
+static void make_matrix(QMatrix<double>& dm, const std::string& kind, unsigned int dim, QSearchRandom& rng)
+{
+    if (kind == "random") random_matrix(dm, dim, rng);
+    else if (kind == "ultrametric") tree_matrix(dm, dim, rng, true, 0.0);
+    else tree_matrix(dm, dim, rng, false, 0.1);
+}
+
+// of the process so far: it only grows from one record to the next
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;     // kilobytes on Linux
+}
+
+struct BenchResult {
+    unsigned int ops;
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+template<class F> static BenchResult time_ops(unsigned int ops, F op)
+{
+    unsigned long long allocs = allocation_count.load();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < ops; i++) op();
+    auto stop = std::chrono::steady_clock::now();
+    BenchResult r;
+    r.ops = ops;
+    r.ns_per_op = std::chrono::duration< double, std::nano >(stop - start).count() / ops;
+    r.allocs_per_op = (double)(allocation_count.load() - allocs) / ops;
+    return r;
+}
+
+template<class Tree, class Move> static BenchResult run_moves(Tree& tree, QSearchRandom& rng, unsigned int ops, Move move)
+{
+    tree.pair_next = tree.PAIR_BATCH;     // pairs come from rng alone, so runs can be repeated
+    return time_ops(ops, [&]() {
+        unsigned int p1, p2;
+        tree.random_pair(p1, p2, rng);
+        move(p1, p2);
+    });
+}
+
+// one JSON object per line in the "benchmarks" array; extra holds further "key": value pairs
+static bool first_record = true;
+
+static void print_result(const char* name, const std::string& matrix, unsigned int leaves, const BenchResult& r,
+                         const std::string& extra = "")
+{
+    std::cout << (first_record ? "\n" : ",\n") << "    { \"name\": \"" << name << "\", \"matrix\": \"" << matrix
+              << "\", \"leaves\": " << leaves << ", \"ops\": " << r.ops << ", \"ns_per_op\": " << r.ns_per_op
+              << ", \"allocs_per_op\": " << r.allocs_per_op << extra << ", \"peak_rss_kb\": " << peak_rss_kb() << " }";
+    first_record = false;
+}
+
+// The kernels of one tree search. The O(n^4) quartet bounds and the whole search only run up to
+// search_leaves; bigger matrices get made-up bounds so that trees on them can still be scored.
+static void bench_kernels(const std::string& kind, unsigned int leaves, QSearchRandom& rng, QSearchThreadPool& pool,
+                          unsigned int search_leaves, double search_seconds)
+{
+    QMatrix<double> dm;
+    make_matrix(dm, kind, leaves, rng);
+    const bool full = leaves <= search_leaves;
+    double sink = 0.0;
+
+    if (full) {
+        for (QSearchThreadPool* p : { (QSearchThreadPool*)nullptr, &pool }) {
+            QSearchTree bounds(dm);
+            print_result("calc_min_max", kind, leaves, time_ops(1, [&]() {
+                dm.quartet_bounds.reset();
+                bounds.calc_min_max(p);
+            }), ", \"threads\": " + std::to_string( p ? p->size() : 1 ));
+        }
+    }
+    else dm.quartet_bounds = std::make_pair(0.0, 1.0);
+
+    QSearchTree start(dm);
+    start.calc_min_max();
+    print_result("connected_node_map", kind, leaves, time_ops(200, [&]() {
+        QSearchConnectedNodeMap map(start);
+        sink += map[0].enter;
+    }));
+    print_result("score_tree_fast_v2", kind, leaves, time_ops(200, [&]() {
+        sink += start.score_tree_fast_v2();
+    }));
+    print_result("full_tree_construct", kind, leaves, time_ops(50, [&]() {
+        QSearchFullTree built(start);
+        sink += built.raw_score;
+    }));
+
+    QSearchFullTree tree(start);
+    const unsigned int ops = 2000;
+    print_result("swap_nodes", kind, leaves, run_moves(tree, rng, ops, [&](unsigned int p1, unsigned int p2) {
+        tree.swap_nodes(p1, p2);
+    }));
+
+    // subtree transfer as done by find_better_tree: two swaps
+    print_result("subtree_transfer", kind, leaves, run_moves(tree, rng, ops, [&](unsigned int p1, unsigned int p2) {
+        unsigned int interior = tree.move_to(p1, p2);
+        unsigned int sibling = tree.find_sibling(p1, p2);
+        tree.swap_nodes(interior, p2);
+        tree.swap_nodes(sibling, p2);
+    }));
+
+    print_result("to_searchtree", kind, leaves, time_ops(200, [&]() {
+        sink += tree.to_searchtree()->total_node_count;
+    }));
+
+    // scoring a move without applying it, as the Metropolis loop does, first on a float copy
+    // of the matrix with the tree in the same shape and the same pairs drawn
+    QMatrix<float> fm(leaves);
+    for (unsigned int i = 0; i < leaves; i++)
+        for (unsigned int j = 0; j < leaves; j++) fm.at(i, j) = dm.at(i, j);
+    fm.quartet_bounds = dm.quartet_bounds;
+    QSearchTreeFloat fstart(fm);
+    fstart.n = tree.to_searchtree()->n;
+    fstart.f_score_good = false;
+    QSearchFullTreeFloat ftree(fstart);
+    QSearchRandom same = rng;
+    print_result("evaluate_swap_float", kind, leaves, run_moves(ftree, same, ops, [&](unsigned int p1, unsigned int p2) {
+        sink += ftree.evaluate_swap(p1, p2);
+    }));
+    same = rng;
+    print_result("evaluate_transfer_float", kind, leaves, run_moves(ftree, same, ops, [&](unsigned int p1, unsigned int p2) {
+        sink += ftree.evaluate_transfer(p1, p2);
+    }));
+    // and on the packed upper triangle, which gathers the left part of every row
+    QSymmetricMatrix<double> sm(dm);
+    sm.quartet_bounds = dm.quartet_bounds;
+    QSearchTreePacked pstart(sm);
+    pstart.n = fstart.n;
+    pstart.f_score_good = false;
+    QSearchFullTreePacked ptree(pstart);
+    same = rng;
+    print_result("evaluate_swap_packed", kind, leaves, run_moves(ptree, same, ops, [&](unsigned int p1, unsigned int p2) {
+        sink += ptree.evaluate_swap(p1, p2);
+    }));
+    same = rng;
+    print_result("evaluate_swap", kind, leaves, run_moves(tree, same, ops, [&](unsigned int p1, unsigned int p2) {
+        sink += tree.evaluate_swap(p1, p2);
+    }));
+    print_result("evaluate_transfer", kind, leaves, run_moves(tree, rng, ops, [&](unsigned int p1, unsigned int p2) {
+        sink += tree.evaluate_transfer(p1, p2);
+    }));
+
+    if (sink == 0.5) std::cout << "";   // keep the evaluations from being optimized away
+
+    if (!full) return;
+    // the whole search from a fixed seed, stopped after search_seconds if it has not converged;
+    // the tree code reports its mutations on std::cout, which would break the JSON
+    std::streambuf* out = std::cout.rdbuf(nullptr);
+    QSearchManager manager(dm, 1);
+    std::atomic< bool > finished(false);
+    std::thread watchdog([&]() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration< double >(search_seconds);
+        while (!finished && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+        if (!finished) manager.stop_search();
+    });
+    double score = 0.0;
+    BenchResult r = time_ops(1, [&]() { score = manager.find_best_tree().score_tree(); });
+    std::cout.rdbuf(out);
+    std::cout.clear();
+    finished = true;
+    watchdog.join();
+    print_result("find_best_tree", kind, leaves, r, ", \"score\": " + std::to_string(score)
+                 + ", \"moves\": " + std::to_string( manager.moves.load() )
+                 + ", \"stopped\": " + ( manager.was_search_stopped() ? "true" : "false" ));
+}
+
+// text matrix parsing, serially and on the pool
+static void bench_parse(unsigned int dim, QSearchRandom& rng, QSearchThreadPool& pool)
+{
+    QMatrix<double> dm;
+    random_matrix(dm, dim, rng);
+    for (unsigned int i = 0; i < dim; i++) dm.labels.push_back( "object" + std::to_string(i) );
+    std::string s;
+    dm.to_string(s);
+    for (QSearchThreadPool* p : { (QSearchThreadPool*)nullptr, &pool }) {
+        QMatrix<double> parsed;
+        BenchResult r = time_ops(1, [&]() { parsed.from_string(s, p); });
+        print_result("from_string", "random", dim, r, ", \"threads\": " + std::to_string( p ? p->size() : 1 )
+                     + ", \"mb_per_s\": " + std::to_string( s.size() / r.ns_per_op * 1e3 ));
+    }
+}
+
+static void print_help_and_exit()
+{
+    std::cerr << "qsearch-bench [options] [leaves ...]\n";
+    std::cerr << "  -m kind      only matrices of this kind: random, ultrametric or noisy_tree\n";
+    std::cerr << "  -n leaves    largest matrix to compute quartet bounds and run whole searches on (default 100)\n";
+    std::cerr << "  -t seconds   stop each whole search after this long (default 30)\n";
+    std::cerr << "  -h           help\n";
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    std::vector< unsigned int > sizes;
+    std::vector< std::string > kinds( std::begin(MATRIX_KINDS), std::end(MATRIX_KINDS) );
+    unsigned int search_leaves = 100;
+    double search_seconds = 30.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) kinds = { argv[++i] };
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) search_leaves = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) search_seconds = atof(argv[++i]);
+        else if (argv[i][0] == '-') print_help_and_exit();
+        else sizes.push_back( atoi(argv[i]) );
+    }
+    if (sizes.empty()) sizes = { 50, 100, 200 };
+    for (auto& kind : kinds)
+        if (std::find( std::begin(MATRIX_KINDS), std::end(MATRIX_KINDS), kind ) == std::end(MATRIX_KINDS)) print_help_and_exit();
+
+    QSearchThreadPool pool;
+    QSearchRandom rng(1);
+    std::cout << "{\n  \"threads\": " << pool.size() << ",\n  \"benchmarks\": [";
+    for (auto& kind : kinds)
+        for (auto leaves : sizes) bench_kernels(kind, leaves, rng, pool, search_leaves, search_seconds);
+    bench_parse(2000, rng, pool);
+    std::cout << "\n  ],\n  \"peak_rss_kb\": " << peak_rss_kb() << "\n}\n";
+    return 0;
+}
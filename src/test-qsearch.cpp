@@ -1,4 +1,16 @@
 #include "SimpleMatrix.hpp"
+#include "QSearchTree.hpp"
+#include "QSearchThreadPool.hpp"
+#include "QSearchFullTree.hpp"
+#include "QSearchNcd.hpp"
+#include "QMatrixFile.hpp"
+#include "QSearchTempering.hpp"
+#include "QSearchManager.hpp"
+#include "QSearchTelemetry.hpp"
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 
 // test for QMatrix - used in main() in initial testing
 void testQMatrix() {
@@ -19,15 +31,528 @@ void testQMatrix() {
     std::cout << s;
     std::cout << "\n";
     write_whole_file( s, "../samples/squares.txt");
-    read_whole_file( s, "../samples/mammals.txt");
+    read_whole_file( s, "../samples/Mammals.txt");
     q.from_string(s);
     std::cout << "\nMatrix read from file\n";
     std::cout << s;
     std::cout << "\n";
 }
 
+// the sample most tests run on, relative to a build directory in the source tree
+const char* const MAMMALS = "../samples/Mammals.txt";
+
+bool read_mammals(std::string& s) {
+    if( !read_whole_file( s, MAMMALS ) ) {
+        std::cout << "run test-qsearch from a build directory in the source tree\n";
+        return false;
+    }
+    return true;
+}
+
+template<class T> bool load_mammals(QMatrix<T>& dm, bool symmetric = true) {
+    std::string s;
+    if( !read_mammals(s) ) return false;
+    if( !dm.from_string(s) ) {
+        std::cout << "cannot parse " << MAMMALS << "\n";
+        return false;
+    }
+    if( symmetric ) dm.make_symmetric();
+    return true;
+}
+
+// the fast scoring kernel must agree with the brute force quartet count on mutated trees
+bool testScoreTree() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchTree tree(dm);
+    bool ok = true;
+    for( int i=0; i<5; i++ ) {
+        tree.complex_mutation();
+        QSearchTree copy(tree);
+        double fast = tree.score_tree();
+        double slow = copy.score_tree_original();
+        if( fabs(fast - slow) > 1e-9 ) {
+            std::cout << "score mismatch: fast " << fast << " brute force " << slow << "\n";
+            ok = false;
+        }
+    }
+    std::cout << "\nscore_tree " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// the cached, parallel score bounds must match a plain loop over all quartets
+bool testQuartetBounds() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    double lo = 0.0, hi = 0.0;
+    for( unsigned int i=0; i<dm.dim; i++ )
+        for( unsigned int j=i+1; j<dm.dim; j++ )
+            for( unsigned int k=j+1; k<dm.dim; k++ )
+                for( unsigned int l=k+1; l<dm.dim; l++ ) {
+                    double c1 = dm.at(i,j) + dm.at(k,l), c2 = dm.at(i,k) + dm.at(j,l), c3 = dm.at(i,l) + dm.at(j,k);
+                    lo += std::min( { c1, c2, c3 } ); hi += std::max( { c1, c2, c3 } );
+                }
+    QSearchThreadPool pool(3);
+    QSearchTree tree(dm);
+    tree.calc_min_max(&pool);
+    QSearchTree copy(tree);
+    bool ok = fabs(tree.dist_min - lo) < 1e-9 * hi && fabs(tree.dist_max - hi) < 1e-9 * hi
+        && copy.dist_min == tree.dist_min && copy.dist_max == tree.dist_max && dm.quartet_bounds.has_value();
+    dm.make_symmetric();
+    ok = ok && !dm.quartet_bounds.has_value();
+    std::cout << "\nquartet bounds " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// a search carried on one QSearchFullTree must end in a better tree whose score matches a fresh one
+bool testFullTreeSearch() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchTree start(dm);
+    start.complex_mutation();
+    start.calc_min_max();
+    std::unique_ptr< QSearchFullTree > live( new QSearchFullTree(start) );
+    QSearchRandom rng(7);
+    bool ok = true;
+    for( int i=0; i<5; i++ ) {
+        double before = live->score();
+        std::unique_ptr< QSearchFullTree > better = live->find_better_tree(4, rng);
+        if( !better ) continue;
+        std::unique_ptr< QSearchTree > t = better->to_searchtree();
+        double cached = t->score_tree();
+        t->f_score_good = false;
+        double fresh = t->score_tree();
+        if( cached != better->score() ) ok = false;
+        if( better->score() <= before || fabs(better->score() - fresh) > 1e-9 ) {
+            std::cout << "search mismatch: before " << before << " live " << better->score() << " fresh " << fresh << "\n";
+            ok = false;
+        }
+        live = std::move(better);
+    }
+    // built on a matrix nobody computed the bounds of yet
+    QMatrix<double> fresh_dm = dm;
+    fresh_dm.quartet_bounds.reset();
+    QSearchTree unscored(fresh_dm);
+    QSearchFullTree unscored_live(unscored);
+    if( !fresh_dm.quartet_bounds || fabs(unscored_live.score() - unscored.score_tree()) > 1e-9 ) {
+        std::cout << "full tree on a matrix without bounds scores " << unscored_live.score() << "\n";
+        ok = false;
+    }
+    std::cout << "\nfull tree search " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// evaluated move deltas must match what applying the move does to the raw score
+bool testMoveDeltas() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchTree start(dm);
+    start.complex_mutation();
+    QSearchFullTree tree(start);
+    QSearchRandom rng(11);
+    bool ok = true;
+    for( int i=0; i<500; i++ ) {
+        unsigned int p1, p2;
+        tree.random_pair(p1, p2, rng);
+        double before = tree.raw_score;
+        double predicted, actual;
+        if( i % 2 ) {
+            predicted = tree.evaluate_swap(p1, p2);
+            tree.swap_nodes(p1, p2);
+        } else {
+            predicted = tree.evaluate_transfer(p1, p2);
+            unsigned int interior = tree.move_to(p1, p2);
+            unsigned int sibling = tree.find_sibling(p1, p2);
+            tree.swap_nodes(interior, p2);
+            tree.swap_nodes(sibling, p2);
+        }
+        actual = tree.raw_score - before;
+        if( fabs(predicted - actual) > 1e-9 * fabs(before) ) {
+            std::cout << (i % 2 ? "swap" : "transfer") << " delta mismatch: predicted " << predicted << " actual " << actual << "\n";
+            ok = false;
+        }
+    }
+    // the incremental sums after all those moves must match a fresh computation
+    QSearchFullTree fresh(tree);
+    fresh.refresh();
+    for( unsigned int i=tree.leaf_count; i<tree.node_count; i++ )
+        for( int k=0; k<3; k++ )
+            if( fabs(tree.map[i].dist[k] - fresh.map[i].dist[k]) > 1e-9 * fabs(fresh.map[i].dist[k]) + 1e-9 ) {
+                std::cout << "node " << i << " branch " << k << " distance " << tree.map[i].dist[k] << " expected " << fresh.map[i].dist[k] << "\n";
+                ok = false;
+            }
+    std::cout << "\nmove deltas " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// NCD matrices: C(x,y) is the size of x and y as one stream, the matrix is symmetric with a zero
+// diagonal, and an object is closer to a light edit of itself than to unrelated data
+bool testNcd() {
+    bool ok = true;
+    std::string text, other;
+    for( int i=0; i<400; i++ ) text += "the quick brown fox jumps over the lazy dog " + std::to_string(i % 37) + "\n";
+    QSearchRandom rng(5);
+    for( int i=0; i<(int)text.size(); i++ ) other += (char)('a' + rng.below(26));
+    std::string edited = text;
+    edited[100] = 'X';
+    std::vector< NcdObject > objects = { { "text", text }, { "edited", edited }, { "other", other } };
+    QSearchThreadPool pool(2);
+    for( auto& name : QSearchCompressor::available() ) {
+        auto c = QSearchCompressor::create(name);
+        if( c->compressed_size(text, other) != c->compressed_size(text + other) ) {
+            std::cout << name << ": pair size differs from the concatenation\n";
+            ok = false;
+        }
+        // resuming a stored state must give the sizes of a fresh stream
+        if( c->prime(text)->compressed_size(other) != c->compressed_size(text, other) ) {
+            std::cout << name << ": primed size differs from the pair\n";
+            ok = false;
+        }
+        QMatrix<double> dm;
+        QSearchNcd(*c, &pool).compute(dm, objects);
+        for( unsigned int i=0; i<dm.dim; i++ )
+            for( unsigned int j=0; j<dm.dim; j++ )
+                if( dm.at(i, j) != dm.at(j, i) || (i == j && dm.at(i, i) != 0.0) ) {
+                    std::cout << name << ": matrix not symmetric with zero diagonal\n";
+                    ok = false;
+                }
+        if( !(dm.at(0, 1) < dm.at(0, 2)) ) {
+            std::cout << name << ": edited copy " << dm.at(0, 1) << " not closer than unrelated " << dm.at(0, 2) << "\n";
+            ok = false;
+        }
+    }
+    std::cout << "\nncd " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// counts the compressions done, to see which ones the cache saves
+struct CountingCompressor : public QSearchCompressor {
+    const QSearchCompressor& inner;
+    mutable std::atomic<int> calls;
+    CountingCompressor(const QSearchCompressor& inner_init) : inner(inner_init), calls(0) {}
+    std::string name() const override { return inner.name(); }
+    size_t compressed_size(std::string_view x, std::string_view y) const override { calls++; return inner.compressed_size(x, y); }
+};
+
+// growing a matrix through the cache compresses only the new pairs and gives the full matrix
+bool testNcdCache() {
+    const std::string filename = "ncd-cache-test.txt";
+    std::remove( filename.c_str() );
+    std::vector< NcdObject > objects;
+    for( int i=0; i<4; i++ ) objects.push_back( { "o" + std::to_string(i), std::string(200 + 50 * i, 'a' + i) + "shared tail" } );
+    std::vector< NcdObject > first( objects.begin(), objects.begin() + 2 );
+    auto gzip = QSearchCompressor::create("gzip");
+    if( !gzip ) return true;    // built without zlib
+    CountingCompressor counting(*gzip);
+    QSearchThreadPool pool(2);
+    bool ok = true;
+
+    QMatrix<double> full, grown;
+    QSearchNcd(*gzip, &pool).compute(full, objects);
+    {
+        QSearchNcdCache cache(filename);
+        QSearchNcd(counting, &pool, &cache).compute(grown, first);
+    }
+    int before = counting.calls;
+    {
+        QSearchNcdCache cache(filename);
+        ok = QSearchNcd(counting, &pool, &cache).extend(grown, objects) && ok;
+    }
+    // two new singles, 2 * 2 old-new pairs and one new-new pair
+    if( counting.calls - before != 7 ) {
+        std::cout << "extending compressed " << counting.calls - before << " times instead of 7\n";
+        ok = false;
+    }
+    for( unsigned int i=0; i<full.dim; i++ )
+        for( unsigned int j=0; j<full.dim; j++ )
+            if( grown.at(i, j) != full.at(i, j) || grown.labels[i] != full.labels[i] ) {
+                std::cout << "grown matrix differs at " << i << " " << j << "\n";
+                ok = false;
+            }
+    before = counting.calls;
+    QMatrix<double> again;
+    {
+        QSearchNcdCache cache(filename);
+        QSearchNcd(counting, &pool, &cache).compute(again, objects);
+    }
+    if( counting.calls != before ) {
+        std::cout << "recomputing a cached matrix compressed " << counting.calls - before << " times\n";
+        ok = false;
+    }
+    // a run interrupted inside the size digits, and a line whose hash is not one
+    const std::string hx = QSearchNcdCache::content_hash("never compressed");
+    {
+        std::ofstream ofs( filename, std::ios_base::binary | std::ios_base::app );
+        ofs << "gzip " << hx.substr(0, 31) << " 99\n" << QSearchNcdCache::single_key("gzip", hx) << " 12";
+    }
+    {
+        QSearchNcdCache cache(filename);
+        size_t size;
+        if( cache.find( QSearchNcdCache::single_key("gzip", hx), size ) || cache.find( "gzip " + hx.substr(0, 31), size ) ) {
+            std::cout << "cache kept a cut-off or malformed line\n";
+            ok = false;
+        }
+    }
+    std::remove( filename.c_str() );
+    std::cout << "\nncd cache " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// a binary matrix file reads back as the symmetrized text matrix, in double and in float
+bool testMatrixFile() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm, false) ) return false;
+    QMatrix<double> symmetric(dm);
+    symmetric.make_symmetric();
+    bool ok = true;
+    for( unsigned int precision : { 8u, 4u } ) {
+        const std::string filename = "matrix-file-test.qsm";
+        ok = QMatrixFile::write( dm, filename, precision ) && ok;
+        ok = QMatrixFile::is_matrix_file( filename ) && !QMatrixFile::is_matrix_file( MAMMALS ) && ok;
+        QMatrixFile mf;
+        QMatrix<double> back;
+        if( mf.open( filename ) ) mf.to_matrix( back );
+        std::remove( filename.c_str() );
+        if( back.dim != dm.dim || back.labels != dm.labels ) {
+            std::cout << "matrix file: dimension or labels differ\n";
+            ok = false;
+            continue;
+        }
+        for( unsigned int i=0; i<dm.dim; i++ )
+            for( unsigned int j=0; j<dm.dim; j++ ) {
+                double expected = precision == 4 ? (double)(float)symmetric.at(i, j) : symmetric.at(i, j);
+                if( back.at(i, j) != expected || mf.value(i, j) != expected ) {
+                    std::cout << "matrix file: value " << i << " " << j << " is " << back.at(i, j) << " not " << expected << "\n";
+                    ok = false;
+                }
+            }
+    }
+    std::cout << "\nmatrix file " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// the parser takes blanks, tabs and CRLF, numeric labels and a pool, and rejects bad shapes
+bool testParseMatrix() {
+    bool ok = true;
+    QMatrix<double> q;
+    unsigned int asymmetric = 99;
+    ok = q.from_string( "  a 0\t1 2\r\n\n7 1 0 3\nc 2 3.5 0   \n", nullptr, &asymmetric ) && ok;
+    if( q.dim != 3 || q.labels != StringList{ "a", "7", "c" } || q.at(2, 1) != 3.5 || asymmetric != 1 ) {
+        std::cout << "parse: blanks, numeric label or asymmetry count wrong\n";
+        ok = false;
+    }
+    ok = q.from_string( "a +0 +1.5e0\nb 1.5 0\n" ) && ok;
+    if( q.dim != 2 || q.at(0, 1) != 1.5 ) {
+        std::cout << "parse: explicit plus signs not read\n";
+        ok = false;
+    }
+    for( auto bad : { "a 0 1\nb 1\n", "a 0 x\nb 1 0\n", "a 0 1\n1 0\n", "a 0 1\na 1 0\n", "a 0 +-1\nb 1 0\n", "a 0 +\nb 1 0\n", "7 0 1 9\n8 1 0\n" } )
+        if( q.from_string( bad ) || q.dim != 0 ) {
+            std::cout << "parse: accepted a bad matrix\n";
+            ok = false;
+        }
+    std::string s;
+    if( !read_mammals(s) ) return false;
+    QMatrix<double> serial, parallel;
+    QSearchThreadPool pool(3);
+    ok = serial.from_string( s ) && parallel.from_string( s, &pool, &asymmetric ) && ok;
+    if( serial.m != parallel.m || serial.labels != parallel.labels || serial.dim != 34 ) {
+        std::cout << "parse: parallel result differs\n";
+        ok = false;
+    }
+    unsigned int expected = 0;
+    for( unsigned int i=0; i<serial.dim; i++ )
+        for( unsigned int j=0; j<=i; j++ ) expected += i == j ? serial.at(i, i) != 0 : serial.at(i, j) != serial.at(j, i);
+    if( asymmetric != expected ) {
+        std::cout << "parse: " << asymmetric << " asymmetric pairs counted across blocks, " << expected << " expected\n";
+        ok = false;
+    }
+    std::cout << "\nparse matrix " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// a float matrix scores the same tree as its double original, to float precision
+bool testFloatScore() {
+    QMatrix<double> dm;
+    QMatrix<float> fm;
+    if( !load_mammals(dm) || !load_mammals(fm) ) return false;
+    bool ok = true;
+    QSearchTree tree(dm);
+    QSearchTreeFloat ftree(fm);
+    QSearchFullTree full(tree);
+    QSearchFullTreeFloat ffull(ftree);
+    double d = tree.score_tree(), f = ftree.score_tree();
+    if( fabs(d - f) > 1e-6 || fabs(full.score() - ffull.score()) > 1e-6 ) {
+        std::cout << "float score " << f << " double score " << d << "\n";
+        ok = false;
+    }
+    std::cout << "\nfloat score " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// the packed triangle reads back the full matrix, in memory and from a mapped file, and a
+// search on it makes the same moves with the same scores
+bool testPackedMatrix() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    bool ok = true;
+    QSymmetricMatrix<double> sm(dm);
+    std::vector<double> row(dm.dim), sum(dm.dim, 0.0), expected(dm.dim, 0.0);
+    for( unsigned int i=0; i<dm.dim; i++ ) {
+        sm.gather_row(i, row.data());
+        sm.add_row(sum.data(), i);
+        dm.add_row(expected.data(), i);
+        for( unsigned int j=0; j<dm.dim; j++ )
+            if( sm.at(i, j) != dm.at(i, j) || row[j] != dm.at(i, j) ) {
+                std::cout << "packed: value " << i << " " << j << " is " << sm.at(i, j) << " not " << dm.at(i, j) << "\n";
+                ok = false;
+            }
+    }
+    if( sum != expected || sm.labels != dm.labels ) {
+        std::cout << "packed: row sums or labels differ\n";
+        ok = false;
+    }
+
+    const std::string filename = "packed-matrix-test.qsm";
+    ok = QMatrixFile::write( dm, filename, 8 ) && ok;
+    {
+        QMatrixFile mf;
+        QSymmetricMatrix<double> mapped;
+        QSymmetricMatrix<float> converted;
+        if( mf.open( filename ) ) {
+            mapped.view( mf );
+            converted.view( mf );
+        }
+        if( !mapped.is_view() || converted.is_view() || mapped.dim != dm.dim || converted.dim != dm.dim ) {
+            std::cout << "packed: file not viewed in place\n";
+            ok = false;
+        }
+        else for( unsigned int i=0; i<dm.dim; i++ )
+            for( unsigned int j=0; j<dm.dim; j++ )
+                if( mapped.at(i, j) != dm.at(i, j) || converted.at(i, j) != (float)dm.at(i, j) ) {
+                    std::cout << "packed: mapped value " << i << " " << j << " differs\n";
+                    ok = false;
+                }
+    }
+    std::remove( filename.c_str() );
+
+    QSearchTree start(dm);
+    QSearchTreePacked pstart(sm);
+    if( fabs(start.score_tree() - pstart.score_tree()) > 1e-12 ) {
+        std::cout << "packed: score " << pstart.score_tree() << " not " << start.score_tree() << "\n";
+        ok = false;
+    }
+    QSearchFullTree tree(start);
+    QSearchFullTreePacked ptree(pstart);
+    QSearchRandom rng(5), prng(5);
+    for( int i=0; i<200 && ok; i++ ) {
+        unsigned int p1, p2;
+        tree.random_pair(p1, p2, rng);
+        ptree.random_pair(p1, p2, prng);
+        double d = i % 2 ? tree.evaluate_swap(p1, p2) : tree.evaluate_transfer(p1, p2);
+        double pd = i % 2 ? ptree.evaluate_swap(p1, p2) : ptree.evaluate_transfer(p1, p2);
+        tree.swap_nodes(p1, p2);
+        ptree.swap_nodes(p1, p2);
+        if( fabs(d - pd) > 1e-9 * fabs(tree.raw_score) || fabs(tree.raw_score - ptree.raw_score) > 1e-9 * fabs(tree.raw_score) ) {
+            std::cout << "packed: move " << i << " scores " << pd << " " << ptree.raw_score << " not " << d << " " << tree.raw_score << "\n";
+            ok = false;
+        }
+    }
+    std::cout << "\npacked matrix " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// tempering must not lose the start tree, must report a best shape that scores what it claims,
+// and must walk the same way for a seed whether the replicas run on a pool or not
+bool testTempering() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchTree start(dm);
+    start.complex_mutation();
+    start.calc_min_max();
+    QSearchFullTree live(start);
+    QSearchTemperingOptions options;
+    options.replicas = 4;
+    QSearchTempering serial(live, options, QSearchRandom(11)), pooled(live, options, QSearchRandom(11));
+    QSearchThreadPool pool(3);
+    for( int i=0; i<40; i++ ) {
+        serial.round();
+        pooled.round(&pool);
+    }
+    bool ok = serial.best.raw_score <= live.raw_score && serial.moves == 40ull * 4 * live.node_count;
+    if( serial.best.raw_score != pooled.best.raw_score || serial.best.connections != pooled.best.connections ) {
+        std::cout << "tempering: pooled run " << pooled.best.raw_score << " differs from serial " << serial.best.raw_score << "\n";
+        ok = false;
+    }
+    std::unique_ptr< QSearchTree > shape = live.to_searchtree(serial.best);
+    QSearchFullTree rebuilt(*shape);
+    if( fabs(rebuilt.raw_score - serial.best.raw_score) > 1e-9 * fabs(rebuilt.raw_score) ) {
+        std::cout << "tempering: best claims " << serial.best.raw_score << " but scores " << rebuilt.raw_score << "\n";
+        ok = false;
+    }
+    std::cout << "\ntempering " << serial.best.raw_score << " from " << live.raw_score << " " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// every annealing step of a bucket attempt is counted once, whichever pool thread ran it
+bool testTelemetry() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchTree start(dm);
+    start.calc_min_max();
+    QSearchFullTree live(start);
+    QSearchThreadPool pool(3);
+    QSearchRandom rng(3);
+    telemetry_reset();
+    live.find_better_tree(6, rng, &pool);
+    QSearchStats stats = telemetry_snapshot();
+    uint64_t histogram = 0;
+    for( auto n : stats.accept_histogram ) histogram += n;
+    uint64_t moves = stats.proposed[MOVE_SWAP] + stats.proposed[MOVE_TRANSFER];
+    bool ok = true;
+#ifdef QSEARCH_TELEMETRY
+    ok = stats.enabled && moves == 6ull * live.node_count && histogram == moves && stats.calls[PHASE_EVALUATE] == moves
+        && stats.accepted[MOVE_SWAP] <= stats.proposed[MOVE_SWAP] && stats.calls[PHASE_FIND_BETTER_TREE] == 1;
+#else
+    ok = !stats.enabled && moves == 0;
+#endif
+    std::cout << "\ntelemetry " << moves << " moves " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// every call of find_best_tree tries every bucket at least once, even a converged forest, and
+// a seed gives the same search on one thread as on several
+bool testSearchRounds() {
+    QMatrix<double> dm;
+    if( !load_mammals(dm) ) return false;
+    QSearchManager manager(dm, 5, 2);
+    QSearchManager serial(dm, 5, 1);
+    double first = manager.find_best_tree().score_tree();
+    uint64_t before = manager.moves;
+    bool ok = serial.find_best_tree().score_tree() == first && serial.moves == before;
+    if( !ok ) std::cout << "search: one thread tried " << serial.moves << " moves, two threads " << before << "\n";
+    double score = manager.find_best_tree().score_tree();
+    uint64_t round = 24ull * manager.live.size() * manager.live[0]->node_count;
+    ok = manager.moves - before >= round && manager.is_done() && ok;
+    std::cout << "\nsearch rounds " << score << " after " << manager.moves - before << " more moves " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
 // for stand-alone test
 int main() {
   testQMatrix();
-  return 0;
+  bool ok = testScoreTree();
+  ok = testQuartetBounds() && ok;
+  ok = testFullTreeSearch() && ok;
+  ok = testMoveDeltas() && ok;
+  ok = testNcd() && ok;
+  ok = testNcdCache() && ok;
+  ok = testMatrixFile() && ok;
+  ok = testParseMatrix() && ok;
+  ok = testFloatScore() && ok;
+  ok = testPackedMatrix() && ok;
+  ok = testSearchRounds() && ok;
+  ok = testTempering() && ok;
+  ok = testTelemetry() && ok;
+  return ok ? 0 : 1;
 }